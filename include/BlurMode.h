@@ -0,0 +1,18 @@
+#ifndef _BLURMODE_H_
+#define _BLURMODE_H_
+
+// Largest radius that PYRAMID_BLUR blurs at full resolution by
+// default. Lower values are faster but lose more detail.
+#ifndef BLUR_PYRAMID_THRESHOLD
+#define BLUR_PYRAMID_THRESHOLD 8.0f
+#endif
+
+namespace canvas {
+  enum BlurMode {
+    KERNEL_BLUR = 1, // direct gaussian convolution, cost grows with radius
+    BOX_BLUR, // three pass box approximation, cost independent of radius
+    PYRAMID_BLUR // kernel blur at reduced resolution, upsampled bilinearly
+  };
+};
+
+#endif
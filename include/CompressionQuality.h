@@ -0,0 +1,13 @@
+#ifndef _COMPRESSIONQUALITY_H_
+#define _COMPRESSIONQUALITY_H_
+
+namespace canvas {
+  // Speed and quality tradeoff of the block compressed formats
+  enum CompressionQuality {
+    COMPRESSION_FAST = 0, // ETC1 low quality, DXT single refinement
+    COMPRESSION_NORMAL, // ETC1 medium quality, DXT two refinements
+    COMPRESSION_HIGH // ETC1 high quality, DXT two refinements
+  };
+};
+
+#endif
@@ -7,10 +7,15 @@
 #include <Surface.h>
 #include <Image.h>
 #include <HitRegion.h>
+#include <ShadowCache.h>
 
 #include <string>
 #include <memory>
 
+// Strokes are joined with miters that reach at most this many times
+// half the line width from the path (the default of Cairo and canvas)
+#define CONTEXT_MITER_LIMIT 10.0
+
 namespace canvas {
   class Context : public GraphicsState {
   public:
@@ -104,15 +109,13 @@ namespace canvas {
       if (hasNativeShadows()) {
 	getDefaultSurface().drawImage(img, p, w, h, getDisplayScale(), globalAlpha.get(), shadowBlur.get(), shadowOffsetX.get(), shadowOffsetY.get(), shadowColor.get(), clipPath, imageSmoothingEnabled.get());
       } else {
-	if (hasShadow()) {
-	  float b = shadowBlur.get(), bs = shadowBlur.get() * getDisplayScale();
-	  float bi = int(ceil(b));
-	  auto shadow = createSurface(getDefaultSurface().getLogicalWidth() + 2 * bi, getDefaultSurface().getLogicalHeight() + 2 * bi, R8);
-	  shadow->drawImage(img, Point(x + b + shadowOffsetX.get(), y + b + shadowOffsetY.get()), w, h, getDisplayScale(), globalAlpha.get(), 0.0f, 0.0f, 0.0f, shadowColor.get(), clipPath, imageSmoothingEnabled.get());
-	  // shadow->colorFill(shadowColor.get());
-	  auto shadow1 = shadow->blur(bs, bs);
-	  auto shadow2 = shadow1->colorize(shadowColor.get());
-	  getDefaultSurface().drawImage(*shadow2, Point(-b, -b), shadow->getLogicalWidth(), shadow->getLogicalHeight(), getDisplayScale(), 1.0f, 0.0f, 0.0f, 0.0f, shadowColor.get(), Path2D(), false);
+	int sx, sy, sw, sh;
+	if (hasShadow() && getShadowBounds(p.x, p.y, p.x + w, p.y + h, sx, sy, sw, sh)) {
+	  auto shadow = createSurface(sw, sh, R8);
+	  Path2D tmp_clipPath = clipPath;
+	  tmp_clipPath.offset(shadowOffsetX.get() - sx, shadowOffsetY.get() - sy);
+	  shadow->drawImage(img, Point(p.x + shadowOffsetX.get() - sx, p.y + shadowOffsetY.get() - sy), w, h, getDisplayScale(), globalAlpha.get(), 0.0f, 0.0f, 0.0f, shadowColor.get(), tmp_clipPath, imageSmoothingEnabled.get());
+	  drawShadow(*shadow, 0, sx, sy, sw, sh);
 	}
 	getDefaultSurface().drawImage(img, p, w, h, getDisplayScale(), globalAlpha.get(), 0.0f, 0.0f, 0.0f, shadowColor.get(), clipPath, imageSmoothingEnabled.get());
       }
@@ -124,16 +127,13 @@ namespace canvas {
       if (hasNativeShadows()) {
 	getDefaultSurface().drawImage(img, p, w, h, getDisplayScale(), globalAlpha.get(), shadowBlur.get(), shadowOffsetX.get(), shadowOffsetY.get(), shadowColor.get(), clipPath, imageSmoothingEnabled.get());
       } else {
-	if (hasShadow()) {
-	  float b = shadowBlur.get(), bs = shadowBlur.get() * getDisplayScale();
-	  float bi = int(ceil(b));
-	  auto shadow = createSurface(getDefaultSurface().getLogicalWidth() + 2 * bi, getDefaultSurface().getLogicalHeight() + 2 * bi, R8);
-	  
-	  shadow->drawImage(img, Point(p.x + b + shadowOffsetX.get(), p.y + b + shadowOffsetY.get()), w, h, getDisplayScale(), globalAlpha.get(), 0.0f, 0.0f, 0.0f, shadowColor.get(), clipPath, imageSmoothingEnabled.get());
-	  // shadow->colorFill(shadowColor.get());
-	  auto shadow1 = shadow->blur(bs, bs);
-	  auto shadow2 = shadow1->colorize(shadowColor.get());
-	  getDefaultSurface().drawImage(*shadow2, Point(-b, -b), shadow->getLogicalWidth(), shadow->getLogicalHeight(), getDisplayScale(), 1.0f, 0.0f, 0.0f, 0.0f, shadowColor.get(), Path2D(), false);
+	int sx, sy, sw, sh;
+	if (hasShadow() && getShadowBounds(p.x, p.y, p.x + w, p.y + h, sx, sy, sw, sh)) {
+	  auto shadow = createSurface(sw, sh, R8);
+	  Path2D tmp_clipPath = clipPath;
+	  tmp_clipPath.offset(shadowOffsetX.get() - sx, shadowOffsetY.get() - sy);
+	  shadow->drawImage(img, Point(p.x + shadowOffsetX.get() - sx, p.y + shadowOffsetY.get() - sy), w, h, getDisplayScale(), globalAlpha.get(), 0.0f, 0.0f, 0.0f, shadowColor.get(), tmp_clipPath, imageSmoothingEnabled.get());
+	  drawShadow(*shadow, 0, sx, sy, sw, sh);
 	}
 	getDefaultSurface().drawImage(img, p, w, h, getDisplayScale(), globalAlpha.get(), 0.0f, 0.0f, 0.0f, shadowColor.get(), clipPath, imageSmoothingEnabled.get());
       }
@@ -163,6 +163,19 @@ namespace canvas {
     }
 #endif
     const std::vector<HitRegion> & getHitRegions() const { return hit_regions; }
+
+    ShadowCache & getShadowCache() { return shadow_cache; }
+    const ShadowCache & getShadowCache() const { return shadow_cache; }
+
+    // Shadows with a larger blur radius in device pixels are blurred at
+    // reduced resolution. Zero blurs all shadows at full resolution.
+    void setShadowBlurThreshold(float threshold) { shadow_blur_threshold = threshold; }
+    float getShadowBlurThreshold() const { return shadow_blur_threshold; }
+    // Number of threads used to blur shadows, 0 meaning all hardware
+    // threads. Like the image operations, the context uses one thread
+    // unless told otherwise.
+    void setNumThreads(unsigned int n) { num_threads = n; }
+    unsigned int getNumThreads() const { return num_threads; }
     
 #if 0
     Style & createPattern(const ImageData & image, const char * repeat) {
@@ -177,20 +190,27 @@ namespace canvas {
       if (hasNativeShadows()) {
 	getDefaultSurface().renderPath(mode, path, style, lineWidth.get(), op, getDisplayScale(), globalAlpha.get(), shadowBlur.get(), shadowOffsetX.get(), shadowOffsetY.get(), shadowColor.get(), clipPath);
       } else {
-	if (hasShadow()) {
-	  float b = shadowBlur.get(), bs = shadowBlur.get() * getDisplayScale();
-	  float bi = int(ceil(b));
-	  auto shadow = createSurface(getDefaultSurface().getLogicalWidth() + 2 * bi, getDefaultSurface().getLogicalHeight() + 2 * bi, R8);
-	  Style shadow_style(this);
-	  shadow_style = shadowColor.get();
+	double min_x, min_y, max_x, max_y;
+	path.getExtents(min_x, min_y, max_x, max_y);
+	double lw = mode == STROKE ? lineWidth.get() / 2 * CONTEXT_MITER_LIMIT + 1 : 1;
+	int sx, sy, sw, sh;
+	if (hasShadow() && getShadowBounds(min_x - lw, min_y - lw, max_x + lw, max_y + lw, sx, sy, sw, sh)) {
 	  Path2D tmp_path = path, tmp_clipPath = clipPath;
-	  tmp_path.offset(shadowOffsetX.get() + bi, shadowOffsetY.get() + bi);
-	  tmp_clipPath.offset(shadowOffsetX.get() + bi, shadowOffsetY.get() + bi);
-	  
-	  shadow->renderPath(mode, tmp_path, shadow_style, lineWidth.get(), op, getDisplayScale(), globalAlpha.get(), 0, 0, 0, shadowColor.get(), tmp_clipPath);
-	  auto shadow1 = shadow->blur(bs, bs);
-	  auto shadow2 = shadow1->colorize(shadowColor.get());
-	  getDefaultSurface().drawImage(*shadow2, Point(-b, -b), shadow->getLogicalWidth(), shadow->getLogicalHeight(), getDisplayScale(), 1.0f, 0.0f, 0.0f, 0.0f, shadowColor.get(), Path2D(), false);
+	  tmp_path.offset(shadowOffsetX.get() - sx, shadowOffsetY.get() - sy);
+	  tmp_clipPath.offset(shadowOffsetX.get() - sx, shadowOffsetY.get() - sy);
+
+	  ShadowCacheKey key;
+	  key.add(int('P')).add(int(mode)).add(int(op)).add(tmp_path).add(tmp_clipPath).add(double(lineWidth.get())).add(double(shadowColor.get().alpha));
+	  auto mask = getShadowMask(key, sw, sh);
+	  if (!mask) {
+	    auto shadow = createSurface(sw, sh, R8);
+	    Style shadow_style(this);
+	    shadow_style = shadowColor.get();
+	    shadow->renderPath(mode, tmp_path, shadow_style, lineWidth.get(), op, getDisplayScale(), globalAlpha.get(), 0, 0, 0, shadowColor.get(), tmp_clipPath);
+	    drawShadow(*shadow, &key, sx, sy, sw, sh);
+	  } else {
+	    drawShadow(*mask, sx, sy, sw, sh);
+	  }
 	}
 	getDefaultSurface().renderPath(mode, path, style, lineWidth.get(), op, getDisplayScale(), globalAlpha.get(), 0, 0, 0, shadowColor.get(), clipPath);
       }
@@ -202,17 +222,47 @@ namespace canvas {
 	getDefaultSurface().renderText(mode, font, style, textBaseline.get(), textAlign.get(), text, p, lineWidth.get(), op, getDisplayScale(), globalAlpha.get(), shadowBlur.get(), shadowOffsetX.get(), shadowOffsetY.get(), shadowColor.get(), clipPath);
       } else {
 	if (hasShadow()) {
-	  float b = shadowBlur.get(), bs = shadowBlur.get() * getDisplayScale();
-	  int bi = int(ceil(b));
-	  auto shadow = createSurface(getDefaultSurface().getLogicalWidth() + 2 * bi, getDefaultSurface().getLogicalHeight() + 2 * bi, R8);
-	  
-	  Style shadow_style(this);
-	  shadow_style = shadowColor.get();
-	  shadow_style.color.alpha = 1.0f;
-	  shadow->renderText(mode, font, shadow_style, textBaseline.get(), textAlign.get(), text, Point(p.x + shadowOffsetX.get() + b, p.y + shadowOffsetY.get() + b), lineWidth.get(), op, getDisplayScale(), globalAlpha.get(), 0.0f, 0.0f, 0.0f, shadowColor.get(), clipPath);
-	  auto shadow1 = shadow->blur(bs, bs);
-	  auto shadow2 = shadow1->colorize(shadowColor.get());
-	  getDefaultSurface().drawImage(*shadow2, Point(-b, -b), shadow->getLogicalWidth(), shadow->getLogicalHeight(), getDisplayScale(), 1.0f, 0.0f, 0.0f, 0.0f, shadowColor.get(), Path2D(), false);
+	  // the font extents are measured at the alphabetic baseline and
+	  // moved like the renderers move the text. Slanted glyphs can
+	  // overhang the width, and stroked ones have mitered joins.
+	  TextMetrics metrics = getDefaultSurface().measureText(font, text, ALPHABETIC, getDisplayScale());
+	  double tw = metrics.width, ascent = fabs(metrics.fontBoundingBoxAscent), descent = fabs(metrics.fontBoundingBoxDescent);
+	  double lw = (mode == STROKE ? lineWidth.get() / 2 * CONTEXT_MITER_LIMIT : 0) + 1, overhang = ascent / 4;
+	  double min_x = p.x, max_x = p.x + tw, min_y = p.y - ascent, max_y = p.y + descent;
+	  if (textAlign.get() == ALIGN_CENTER) {
+	    min_x -= tw / 2;
+	    max_x -= tw / 2;
+	  } else if (textAlign.get() == ALIGN_RIGHT) {
+	    min_x -= tw;
+	    max_x -= tw;
+	  }
+	  if (textBaseline.get() == TOP) {
+	    min_y += ascent;
+	    max_y += ascent;
+	  } else if (textBaseline.get() == MIDDLE) {
+	    min_y += (ascent - descent) / 2;
+	    max_y += (ascent - descent) / 2;
+	  }
+	  int sx, sy, sw, sh;
+	  if (getShadowBounds(min_x - overhang - lw, min_y - lw, max_x + overhang + lw, max_y + lw, sx, sy, sw, sh)) {
+	    Point tmp_p(p.x + shadowOffsetX.get() - sx, p.y + shadowOffsetY.get() - sy);
+	    Path2D tmp_clipPath = clipPath;
+	    tmp_clipPath.offset(shadowOffsetX.get() - sx, shadowOffsetY.get() - sy);
+
+	    ShadowCacheKey key;
+	    key.add(int('T')).add(int(mode)).add(int(op)).add(text).add(font).add(int(textBaseline.get())).add(int(textAlign.get())).add(tmp_p.x).add(tmp_p.y).add(tmp_clipPath).add(double(lineWidth.get()));
+	    auto mask = getShadowMask(key, sw, sh);
+	    if (!mask) {
+	      auto shadow = createSurface(sw, sh, R8);
+	      Style shadow_style(this);
+	      shadow_style = shadowColor.get();
+	      shadow_style.color.alpha = 1.0f;
+	      shadow->renderText(mode, font, shadow_style, textBaseline.get(), textAlign.get(), text, tmp_p, lineWidth.get(), op, getDisplayScale(), globalAlpha.get(), 0.0f, 0.0f, 0.0f, shadowColor.get(), tmp_clipPath);
+	      drawShadow(*shadow, &key, sx, sy, sw, sh);
+	    } else {
+	      drawShadow(*mask, sx, sy, sw, sh);
+	    }
+	  }
 	}
 	getDefaultSurface().renderText(mode, font, style, textBaseline.get(), textAlign.get(), text, p, lineWidth.get(), op, getDisplayScale(), globalAlpha.get(), 0.0f, 0.0f, 0.0f, shadowColor.get(), clipPath);
       }
@@ -220,6 +270,62 @@ namespace canvas {
     }
 
     bool hasShadow() const { return shadowBlur.get() > 0.0f || shadowOffsetX.get() != 0 || shadowOffsetY.get() != 0; }
+
+    // Calculates the area of the shadow surface for content within the
+    // given extents: the offset content grown by the blur radius,
+    // limited to the canvas, plus the blur radius of source around it.
+    // Returns false if the shadow is not visible.
+    bool getShadowBounds(double min_x, double min_y, double max_x, double max_y, int & x, int & y, int & width, int & height) const {
+      double margin = ceil(shadowBlur.get()) + 1;
+      min_x += shadowOffsetX.get() - margin;
+      min_y += shadowOffsetY.get() - margin;
+      max_x += shadowOffsetX.get() + margin;
+      max_y += shadowOffsetY.get() + margin;
+      if (min_x < 0) min_x = 0;
+      if (min_y < 0) min_y = 0;
+      if (max_x > getWidth()) max_x = getWidth();
+      if (max_y > getHeight()) max_y = getHeight();
+      if (min_x >= max_x || min_y >= max_y) return false;
+      x = int(floor(min_x - margin));
+      y = int(floor(min_y - margin));
+      width = int(ceil(max_x + margin)) - x;
+      height = int(ceil(max_y + margin)) - y;
+      return true;
+    }
+
+    // Looks up a blurred mask from the shadow cache. The key is
+    // completed with the parameters shared by all shadows. Geometry is
+    // given relative to the shadow surface, so content that moves by
+    // whole pixels still hits the cache.
+    std::shared_ptr<ImageData> getShadowMask(ShadowCacheKey & key, int width, int height) {
+      key.add(width).add(height).add(double(shadowBlur.get())).add(double(getDisplayScale())).add(double(globalAlpha.get())).add(double(shadow_blur_threshold));
+      return shadow_cache.get(key);
+    }
+
+    // Blurs and colorizes a shadow surface and draws it at (x, y). If
+    // a key is given and the mask fits in the shadow cache, the blurred
+    // mask is cached. Otherwise blurring and colorizing are fused into
+    // one pass that writes directly to the surface that is drawn.
+    void drawShadow(Surface & shadow, const ShadowCacheKey * key, int x, int y, int width, int height) {
+      float bs = shadowBlur.get() * getDisplayScale();
+      BlurMode mode = shadow_blur_threshold > 0.0f && bs > shadow_blur_threshold ? PYRAMID_BLUR : BOX_BLUR;
+      if (key && ImageData::calculateSize(shadow.getActualWidth(), shadow.getActualHeight(), 1) <= shadow_cache.getBudget()) {
+	std::shared_ptr<ImageData> mask(shadow.blur(bs, bs, mode, num_threads, shadow_blur_threshold));
+	shadow_cache.put(*key, mask);
+	drawShadow(*mask, x, y, width, height);
+      } else {
+	auto colorized = createSurface(width, height, 4);
+	shadow.blurColorize(*colorized, bs, bs, shadowColor.get(), mode, num_threads, shadow_blur_threshold);
+	getDefaultSurface().drawImage(*colorized, Point(x, y), width, height, getDisplayScale(), 1.0f, 0.0f, 0.0f, 0.0f, shadowColor.get(), Path2D(), false);
+      }
+    }
+
+    // Colorizes a blurred shadow mask and draws it at (x, y)
+    void drawShadow(const ImageData & mask, int x, int y, int width, int height) {
+      auto colorized = createSurface(width, height, 4);
+      colorized->colorizeMask(mask, shadowColor.get());
+      getDefaultSurface().drawImage(*colorized, Point(x, y), width, height, getDisplayScale(), 1.0f, 0.0f, 0.0f, 0.0f, shadowColor.get(), Path2D(), false);
+    }
     
   private:
     float display_scale;
@@ -227,6 +333,9 @@ namespace canvas {
     std::vector<GraphicsState> restore_stack;
     std::vector<HitRegion> hit_regions;
     HitRegion null_region;
+    ShadowCache shadow_cache;
+    float shadow_blur_threshold = BLUR_PYRAMID_THRESHOLD;
+    unsigned int num_threads = 1;
   };
     
   class ContextFactory {
@@ -26,6 +26,16 @@ namespace canvas {
     std::unique_ptr<Image> createImage(float display_scale) override;
 
     cairo_surface_t * getCairoSurface() { return surface; }
+
+    size_t getBytesPerRow() const override { return cairo_image_surface_get_stride(surface); }
+    // ARGB32 pixels are native endian words
+    bool isBGRA() const override {
+#if defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      return false;
+#else
+      return getNumChannels() == 4;
+#endif
+    }
     
   protected:
     void flush();
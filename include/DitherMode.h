@@ -0,0 +1,13 @@
+#ifndef _DITHERMODE_H_
+#define _DITHERMODE_H_
+
+namespace canvas {
+  // How images are dithered when they are packed to 16-bit formats
+  enum DitherMode {
+    DITHER_FLOYD_STEINBERG = 1, // error diffusion, best quality but serial within a row
+    DITHER_BAYER, // 8x8 ordered matrix, every pixel independent
+    DITHER_BLUE_NOISE // 64x64 tileable blue noise mask, every pixel independent
+  };
+};
+
+#endif
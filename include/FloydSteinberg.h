@@ -2,19 +2,31 @@
 #define _FLOYDSTEINBERG_H_
 
 #include <InternalFormat.h>
+#include <cstddef>
 #include <memory>
 
 namespace canvas {
-  class ImageData;
+  class ImageDataView;
+  class PixelBuffer;
 
   class FloydSteinberg  {
   public:
-    FloydSteinberg(InternalFormat _target_format) : target_format(_target_format) { }
+    // With unpremultiply set, four channel input is premultiplied and
+    // the output has straight alpha
+    FloydSteinberg(InternalFormat _target_format, bool _unpremultiply = false) : target_format(_target_format), unpremultiply(_unpremultiply) { }
 
-    unsigned int apply(const ImageData & input_image, unsigned char * output, unsigned int bytesPerRow) const;
+    // Returns the number of bytes written. With several threads the
+    // rows are dithered as a diagonal wavefront, with the same result
+    // as a single thread. num_threads = 0 uses all hardware threads.
+    size_t apply(const ImageDataView & input_image, unsigned char * output, size_t bytesPerRow, unsigned int num_threads = 1) const;
+    // Dithers the next rows of an image that is processed in bands. The
+    // error carried to the following rows is kept in state, which
+    // starts a new image when it is empty.
+    size_t apply(const ImageDataView & input_image, unsigned char * output, size_t bytesPerRow, PixelBuffer & state) const;
 
   private:
     InternalFormat target_format;
+    bool unpremultiply;
   };
 };
 
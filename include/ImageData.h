@@ -2,6 +2,10 @@
 #define _IMAGEDATA_H_
 
 #include <Color.h>
+#include <BlurMode.h>
+#include <ResizeFilter.h>
+#include <ImageDataView.h>
+#include <PixelBuffer.h>
 
 #include <cstring>
 #include <memory>
@@ -12,58 +16,91 @@ namespace canvas {
     static ImageData nullImage;
 
   ImageData() : width(0), height(0), num_channels(0) { }
-  ImageData(const unsigned char * _data, unsigned short _width, unsigned short _height, unsigned short _num_channels)
-    : width(_width), height(_height), num_channels(_num_channels)
+  ImageData(const unsigned char * _data, unsigned int _width, unsigned int _height, unsigned int _num_channels)
+    : width(_width), height(_height), num_channels(_num_channels),
+      data(std::make_shared<PixelBuffer>(calculateSize(), !_data))
     {
-      size_t s = calculateSize();
-      data = std::unique_ptr<unsigned char[]>(new unsigned char[s]);
-      if (!_data) {
-	memset(data.get(), 0, s);
-      } else {
-	memcpy(data.get(), _data, s);
-      }
-    }
-  ImageData(unsigned short _width, unsigned short _height, unsigned short _num_channels)
-    : width(_width), height(_height), num_channels(_num_channels) {
-      size_t s = calculateSize();
-      data = std::unique_ptr<unsigned char[]>(new unsigned char[s]);
-      memset(data.get(), 0, s);  
+      if (_data) memcpy(data->get(), _data, calculateSize());
     }
+    // zero_fill can be disabled when the caller writes every byte
+  ImageData(unsigned int _width, unsigned int _height, unsigned int _num_channels, bool zero_fill = true)
+    : width(_width), height(_height), num_channels(_num_channels),
+      data(std::make_shared<PixelBuffer>(calculateSize(), zero_fill)) { }
 
+    // Copies share the pixels until one of them asks for writable data
     ImageData(const ImageData & other)
-      : width(other.getWidth()), height(other.getHeight()), num_channels(other.num_channels)
-    {
-      size_t s = calculateSize();
-      data = std::unique_ptr<unsigned char[]>(new unsigned char[s]);
-      if (other.getData()) {
-	memcpy(data.get(), other.getData(), s);
-      } else {
-	memset(data.get(), 0, s);
-      }
-    }
+      : width(other.getWidth()), height(other.getHeight()), num_channels(other.num_channels), premultiplied(other.premultiplied),
+      data(other.data) { }
 
     ImageData & operator=(const ImageData & other) = delete;
     
-    std::unique_ptr<ImageData> scale(unsigned short target_width, unsigned short target_height) const;
-    std::unique_ptr<ImageData> colorize(const Color & color) const;
-    std::unique_ptr<ImageData> blur(float hradius, float vradius) const;
+    // num_threads = 0 uses all hardware threads. Scaling with more
+    // than one thread resizes bands of rows separately, and since the
+    // filter weights are then computed from other offsets, pixels can
+    // differ by one from the single threaded result. The result also
+    // depends on the number of bands, so use one thread (the default)
+    // when the output must be reproducible. RESIZE_EDGE_WRAP needs
+    // the rows of both edges and is always scaled in one band.
+    std::unique_ptr<ImageData> scale(unsigned int target_width, unsigned int target_height, ResizeFilter filter = RESIZE_FILTER_DEFAULT, ResizeEdge edge = RESIZE_EDGE_CLAMP, unsigned int num_threads = 1) const {
+      return scale(ImageDataView(*this), target_width, target_height, filter, edge, num_threads);
+    }
+    std::unique_ptr<ImageData> colorize(const Color & color, bool premultiplied_output = true) const {
+      return colorize(ImageDataView(*this), color, premultiplied_output);
+    }
+    std::unique_ptr<ImageData> blur(float hradius, float vradius, BlurMode mode = KERNEL_BLUR, unsigned int num_threads = 1, float pyramid_threshold = BLUR_PYRAMID_THRESHOLD) const {
+      return blur(ImageDataView(*this), hradius, vradius, mode, num_threads, pyramid_threshold);
+    }
+    std::unique_ptr<ImageData> halve(bool srgb = false, unsigned int num_threads = 1) const {
+      return halve(ImageDataView(*this), srgb, num_threads);
+    }
+
+    // The same operations for strided data that is not owned by an ImageData
+    static std::unique_ptr<ImageData> scale(const ImageDataView & input, unsigned int target_width, unsigned int target_height, ResizeFilter filter = RESIZE_FILTER_DEFAULT, ResizeEdge edge = RESIZE_EDGE_CLAMP, unsigned int num_threads = 1);
+    static std::unique_ptr<ImageData> colorize(const ImageDataView & input, const Color & color, bool premultiplied_output = true);
+    static std::unique_ptr<ImageData> blur(const ImageDataView & input, float hradius, float vradius, BlurMode mode = KERNEL_BLUR, unsigned int num_threads = 1, float pyramid_threshold = BLUR_PYRAMID_THRESHOLD);
+    // Creates the next mipmap level by averaging 2x2 blocks. The size
+    // is rounded up, so odd edges are averaged with themselves. With
+    // srgb set, the color channels are averaged in linear light.
+    static std::unique_ptr<ImageData> halve(const ImageDataView & input, bool srgb = false, unsigned int num_threads = 1);
+
+    // Writes a one channel image colorized as premultiplied native
+    // endian ARGB32 (the Cairo layout) to output
+    void colorize(const Color & color, unsigned char * output, size_t bytesPerRow) const;
+    // Blurs one channel input and writes it colorized as premultiplied
+    // ARGB32 to output without intermediate images
+    static void blurColorize(const unsigned char * input, size_t input_bytesPerRow, unsigned int width, unsigned int height, float hradius, float vradius, const Color & color, unsigned char * output, size_t output_bytesPerRow, BlurMode mode = KERNEL_BLUR, unsigned int num_threads = 1, float pyramid_threshold = BLUR_PYRAMID_THRESHOLD);
 
     bool isValid() const { return width != 0 && height != 0 && num_channels != 0; }
-    unsigned short getWidth() const { return width; }
-    unsigned short getHeight() const { return height; }
-    unsigned short getNumChannels() const { return num_channels; }
 
-    unsigned char * getData() { return data.get(); }
-    const unsigned char * getData() const { return data.get(); }
+    // Tells whether the color channels of four channel data have been
+    // multiplied by alpha (the default, and the layout of Cairo
+    // surfaces) or if alpha is straight (as decoded from image files)
+    bool isPremultiplied() const { return premultiplied; }
+    void setPremultiplied(bool p) { premultiplied = p; }
+
+    unsigned int getWidth() const { return width; }
+    unsigned int getHeight() const { return height; }
+    unsigned int getNumChannels() const { return num_channels; }
 
-    unsigned short getBytesPerRow() const { return num_channels * width; }
+    // Returns writable pixels, copying them first if they are shared
+    unsigned char * getData() {
+      if (data.use_count() > 1) detach();
+      return data ? data->get() : 0;
+    }
+    const unsigned char * getData() const { return data ? data->get() : 0; }
+    bool isShared() const { return data.use_count() > 1; }
+
+    size_t getBytesPerRow() const { return size_t(num_channels) * width; }
     
-    static size_t calculateSize(unsigned short width, unsigned short height, unsigned short num_channels) { return width * height * num_channels; }
+    static size_t calculateSize(unsigned int width, unsigned int height, unsigned int num_channels) { return size_t(width) * height * num_channels; }
     size_t calculateSize() const { return calculateSize(width, height, num_channels); }
     
   private:
-    unsigned short width, height, num_channels;
-    std::unique_ptr<unsigned char[]> data;
+    unsigned int width, height, num_channels;
+    bool premultiplied = true;
+    void detach();
+
+    std::shared_ptr<PixelBuffer> data;
   };
 };
 #endif
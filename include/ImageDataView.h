@@ -0,0 +1,47 @@
+#ifndef _IMAGEDATAVIEW_H_
+#define _IMAGEDATAVIEW_H_
+
+#include <cstddef>
+
+namespace canvas {
+  class ImageData;
+
+  // Non-owning view of pixel data with an explicit row stride, for
+  // processing locked surface memory without copying it. The data must
+  // stay valid while the view is used.
+  class ImageDataView {
+  public:
+  ImageDataView() : data(0), width(0), height(0), num_channels(0), bytesPerRow(0) { }
+  ImageDataView(const unsigned char * _data, unsigned int _width, unsigned int _height, unsigned int _num_channels, size_t _bytesPerRow = 0, bool _premultiplied = true, bool _bgra = false)
+    : data(_data), width(_width), height(_height), num_channels(_num_channels),
+      bytesPerRow(_bytesPerRow ? _bytesPerRow : size_t(_width) * _num_channels),
+      premultiplied(_premultiplied), bgra(_bgra && _num_channels == 4) { }
+    ImageDataView(const ImageData & image);
+
+    bool isValid() const { return data && width != 0 && height != 0 && num_channels != 0; }
+    bool isPremultiplied() const { return premultiplied; }
+    // Tells whether four channel pixels are in BGRA byte order, like
+    // Cairo surfaces on little endian machines. The packers reorder
+    // them to RGBA.
+    bool isBGRA() const { return bgra; }
+
+    unsigned int getWidth() const { return width; }
+    unsigned int getHeight() const { return height; }
+    unsigned int getNumChannels() const { return num_channels; }
+    size_t getBytesPerRow() const { return bytesPerRow; }
+
+    const unsigned char * getData() const { return data; }
+    const unsigned char * getRow(unsigned int row) const { return data + row * bytesPerRow; }
+
+    // true if the rows follow each other without padding
+    bool isContiguous() const { return bytesPerRow == size_t(width) * num_channels; }
+
+  private:
+    const unsigned char * data;
+    unsigned int width, height, num_channels;
+    size_t bytesPerRow;
+    bool premultiplied = true, bgra = false;
+  };
+};
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef _ORDEREDDITHER_H_
+#define _ORDEREDDITHER_H_
+
+#include <InternalFormat.h>
+#include <DitherMode.h>
+#include <cstddef>
+
+namespace canvas {
+  class ImageDataView;
+
+  // Dithers to RGBA4, RGB565, RGB555 or RGBA5551 by adding a threshold
+  // from a repeating mask before truncating. Unlike error diffusion
+  // the pixels do not depend on each other, so the result is stable
+  // between frames where the input does not change.
+  class OrderedDither {
+  public:
+    // With unpremultiply set, four channel input is premultiplied and
+    // the output has straight alpha
+    OrderedDither(InternalFormat _target_format, DitherMode _mode = DITHER_BAYER, bool _unpremultiply = false) : target_format(_target_format), mode(_mode), unpremultiply(_unpremultiply) { }
+
+    // Returns the number of bytes written. num_threads = 0 uses all
+    // hardware threads. first_row is the row of the whole image where
+    // the input starts, so that bands of it line up with the mask.
+    size_t apply(const ImageDataView & input_image, unsigned char * output, size_t bytesPerRow, unsigned int num_threads = 1, unsigned int first_row = 0) const;
+
+  private:
+    InternalFormat target_format;
+    DitherMode mode;
+    bool unpremultiply;
+  };
+};
+
+#endif
@@ -2,37 +2,50 @@
 #define _PACKEDIMAGEDATA_H_
 
 #include <InternalFormat.h>
+#include <CompressionQuality.h>
+#include <DitherMode.h>
 
 #include <memory>
 
 namespace canvas {
-  class ImageData;
+  class ImageDataView;
+  class PixelBuffer;
   
   class PackedImageData {
   public:
-  PackedImageData() : format(NO_FORMAT), width(0), height(0), levels(0), quality(0) { }
-    PackedImageData(InternalFormat _format, unsigned short _levels, const ImageData & input);
-    PackedImageData(InternalFormat _format, unsigned short _width, unsigned short _height, unsigned short _levels, const unsigned char * input = 0);
+  PackedImageData() : format(NO_FORMAT), width(0), height(0), levels(0), quality(COMPRESSION_NORMAL), premultiplied(true) { }
+    // Levels after the first are created by halving the previous one.
+    // With srgb_mipmaps set, the colors are averaged in linear light.
+    // Block compressed formats are encoded at the given quality with
+    // num_threads threads (0 uses all hardware threads), with the same
+    // result for any count. The 16-bit formats are dithered with the
+    // given mode. Without premultiplied_output, premultiplied four
+    // channel input is divided by alpha while it is packed.
+    PackedImageData(InternalFormat _format, unsigned int _levels, const ImageDataView & input, CompressionQuality _quality = COMPRESSION_NORMAL, DitherMode dither = DITHER_FLOYD_STEINBERG, bool premultiplied_output = true, bool srgb_mipmaps = false, unsigned int num_threads = 1);
+    PackedImageData(InternalFormat _format, unsigned int _width, unsigned int _height, unsigned int _levels, const unsigned char * input = 0);
   
-    void setQuality(unsigned short _quality) { quality = _quality; }
-    unsigned short getQuality() const { return quality; }
+    // The quality the data was encoded with
+    CompressionQuality getQuality() const { return quality; }
+
+    // Tells whether the color channels have been multiplied by alpha
+    bool isPremultiplied() const { return premultiplied; }
     
-    unsigned short getWidth() const { return width; }
-    unsigned short getHeight() const { return height; }
-    unsigned short getBytesPerRow() const { return getBytesPerRow(width, format); }
-    unsigned short getBytesPerPixel() const { return getBytesPerPixel(format); }
+    unsigned int getWidth() const { return width; }
+    unsigned int getHeight() const { return height; }
+    size_t getBytesPerRow() const { return getBytesPerRow(width, format); }
+    unsigned int getBytesPerPixel() const { return getBytesPerPixel(format); }
     InternalFormat getInternalFormat() const { return format; }
 
-    static unsigned short getBytesPerRow(unsigned short width, InternalFormat format) {
-      unsigned short bpp = getBytesPerPixel(format);
+    static size_t getBytesPerRow(unsigned int width, InternalFormat format) {
+      size_t bpp = getBytesPerPixel(format);
 #ifdef __APPLE__
-      return (bpp * width + 63) & ~63;
+      return (bpp * width + 63) & ~size_t(63);
 #else
       return bpp * width;
 #endif
     }
     
-    static unsigned short getBytesPerPixel(InternalFormat format) {
+    static unsigned int getBytesPerPixel(InternalFormat format) {
       switch (format) {
       case NO_FORMAT: return 0;
       case R8: return 1;
@@ -55,17 +68,24 @@ namespace canvas {
       return 0;
     }
 
-    static size_t calculateOffset(unsigned short width, unsigned short height, unsigned short level, InternalFormat format) {
+    // Packs the rows of one level, starting at first_row of the level,
+    // to output. Bands of block formats must start at a block row, and
+    // bands dithered with Floyd-Steinberg continue from the error kept
+    // in fs_state, which an empty buffer starts. Without fs_state the
+    // input must be the whole level.
+    static void packRows(InternalFormat format, const ImageDataView & input, unsigned int first_row, unsigned char * output, CompressionQuality quality = COMPRESSION_NORMAL, DitherMode dither = DITHER_FLOYD_STEINBERG, bool unpremultiply = false, unsigned int num_threads = 1, PixelBuffer * fs_state = 0);
+
+    static size_t calculateOffset(unsigned int width, unsigned int height, unsigned int level, InternalFormat format) {
       size_t s = 0;
       if (format == RGB_ETC1 || format == RGB_DXT1 || format == RED_RGTC1) {
 	for (unsigned int l = 0; l < level; l++) {
-	  s += 8 * ((width + 3) / 4) * ((height + 3) / 4);
+	  s += 8 * size_t((width + 3) / 4) * ((height + 3) / 4);
 	  width = (width + 1) / 2;
 	  height = (height + 1) / 2;
 	}
-      } else if (format == RG_RGTC2) {
+      } else if (format == RG_RGTC2 || format == RGBA_DXT5) {
 	for (unsigned int l = 0; l < level; l++) {
-	  s += 16 * ((width + 3) / 4) * ((height + 3) / 4);
+	  s += 16 * size_t((width + 3) / 4) * ((height + 3) / 4);
 	  width = (width + 1) / 2;
 	  height = (height + 1) / 2;
 	}
@@ -79,11 +99,11 @@ namespace canvas {
       return s;
     }
     
-    size_t calculateOffset(unsigned short level) const {
+    size_t calculateOffset(unsigned int level) const {
       return calculateOffset(width, height, level, format);
     }
 
-    static size_t calculateSize(unsigned short width, unsigned short height, unsigned short levels, InternalFormat format) {
+    static size_t calculateSize(unsigned int width, unsigned int height, unsigned int levels, InternalFormat format) {
       return calculateOffset(width, height, levels, format);
     }
     
@@ -95,17 +115,16 @@ namespace canvas {
     }
 
     const unsigned char * getData() const { return data.get(); }
-    const unsigned char * getDataForLevel(unsigned short level) {
+    const unsigned char * getDataForLevel(unsigned int level) {
       return data.get() + calculateOffset(level);
     }
 
   private:
     InternalFormat format;
-    unsigned short width, height, levels;
-    unsigned short quality;
+    unsigned int width, height, levels;
+    CompressionQuality quality;
+    bool premultiplied;
     std::unique_ptr<unsigned char[]> data;
-    
-    static bool etc1_initialized;
   };
 };
 
@@ -0,0 +1,73 @@
+#ifndef _PACKEDIMAGESTREAM_H_
+#define _PACKEDIMAGESTREAM_H_
+
+#include <InternalFormat.h>
+#include <CompressionQuality.h>
+#include <DitherMode.h>
+#include <PixelBuffer.h>
+
+#include <functional>
+#include <vector>
+
+namespace canvas {
+  class ImageDataView;
+
+  // Packs an image that arrives a few rows at a time, for images too
+  // large to hold in memory. The rows of each level are collected in
+  // bands of band_rows rows, which are packed and passed to the sink
+  // as soon as they are complete, and pairs of rows are halved into
+  // the next level as they arrive. Memory use depends on the width
+  // and band_rows but not on the height.
+  //
+  // The sink receives the packed data of each level in order, in the
+  // layout of PackedImageData, so the data of a level starts at
+  // PackedImageData::calculateOffset(width, height, level, format). The
+  // levels are interleaved: a band of a small level is emitted when
+  // enough rows of the larger levels have been added.
+  class PackedImageStream {
+  public:
+    typedef std::function<void(unsigned int level, const unsigned char * data, size_t size)> Sink;
+
+    // band_rows is rounded up to a multiple of four. The other options
+    // are those of the PackedImageData constructor, and the output is
+    // the same.
+    PackedImageStream(InternalFormat _format, unsigned int _width, unsigned int _height, unsigned int _num_channels, unsigned int _levels, Sink _sink, CompressionQuality _quality = COMPRESSION_NORMAL, DitherMode _dither = DITHER_FLOYD_STEINBERG, bool _premultiplied_output = true, bool _srgb_mipmaps = false, unsigned int _num_threads = 1, unsigned int _band_rows = 64);
+    PackedImageStream(const PackedImageStream & other) = delete;
+    PackedImageStream & operator=(const PackedImageStream & other) = delete;
+
+    // Adds the next rows of the image. The rows must have the width
+    // and channel count of the image, and the channel order and alpha
+    // of the first rows.
+    void addRows(const ImageDataView & rows);
+    // Tells whether all rows have been added and packed
+    bool isComplete() const { return !levels.empty() && levels[0].next_row == height; }
+
+    InternalFormat getInternalFormat() const { return format; }
+    unsigned int getWidth() const { return width; }
+    unsigned int getHeight() const { return height; }
+    unsigned int getNumLevels() const { return (unsigned int)levels.size(); }
+
+  private:
+    struct Level {
+      unsigned int width, height;
+      unsigned int band_start = 0, next_row = 0;
+      PixelBuffer band, fs_state;
+    };
+
+    unsigned char * getRowSlot(unsigned int level);
+    void commitRow(unsigned int level);
+    void flush(unsigned int level);
+
+    InternalFormat format;
+    unsigned int width, height, num_channels;
+    Sink sink;
+    CompressionQuality quality;
+    DitherMode dither;
+    bool premultiplied_output, srgb_mipmaps, premultiplied_input = true, bgra_input = false;
+    unsigned int num_threads, band_rows;
+    std::vector<Level> levels;
+    PixelBuffer output;
+  };
+};
+
+#endif
@@ -63,10 +63,12 @@ namespace canvas {
 	min_x = max_x = it->x0;
 	min_y = max_y = it->y0;
 	for (auto & pc : data) {
-	  if (pc.x0 < min_x) min_x = pc.x0;
-	  if (pc.y0 < min_y) min_y = pc.x0;
-	  if (pc.x0 < max_x) max_x = pc.y0;
-	  if (pc.y0 < max_y) max_y = pc.y0;
+	  if (pc.type == PathComponent::CLOSE) continue;
+	  // arcs are bounded by their full circle
+	  if (pc.x0 - pc.radius < min_x) min_x = pc.x0 - pc.radius;
+	  if (pc.y0 - pc.radius < min_y) min_y = pc.y0 - pc.radius;
+	  if (pc.x0 + pc.radius > max_x) max_x = pc.x0 + pc.radius;
+	  if (pc.y0 + pc.radius > max_y) max_y = pc.y0 + pc.radius;
 	}
       }
     }
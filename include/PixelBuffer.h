@@ -0,0 +1,133 @@
+#ifndef _PIXELBUFFER_H_
+#define _PIXELBUFFER_H_
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+// Alignment of all pixel buffers, enough for any SIMD load
+#define PIXEL_BUFFER_ALIGNMENT 64
+
+namespace canvas {
+  // Interface for the allocators that provide pixel memory. The
+  // returned memory must be aligned to PIXEL_BUFFER_ALIGNMENT.
+  class PixelAllocator {
+  public:
+    virtual ~PixelAllocator() = default;
+
+    virtual unsigned char * allocate(size_t size) = 0;
+    virtual void deallocate(unsigned char * ptr, size_t size) = 0;
+
+    // The allocator used by new buffers. Setting null restores the
+    // built-in pooled allocator. Buffers remember their allocator, so
+    // the default can be changed while buffers are alive, but the
+    // allocator must outlive them.
+    static PixelAllocator & getDefault();
+    static void setDefault(PixelAllocator * allocator);
+
+    static unsigned char * allocateAligned(size_t size);
+    static void freeAligned(unsigned char * ptr);
+  };
+
+  // Allocates straight from the system without caching
+  class SystemPixelAllocator : public PixelAllocator {
+  public:
+    unsigned char * allocate(size_t size) override { return allocateAligned(size); }
+    void deallocate(unsigned char * ptr, size_t) override { freeAligned(ptr); }
+  };
+
+  // Keeps freed buffers in free lists by size class and hands them out
+  // again. Sizes are rounded up to four classes per power of two.
+  // Buffers larger than max_buffer_size bypass the pools, and freed
+  // buffers that would take the cached total over max_cached_bytes are
+  // returned to the system.
+  class PooledPixelAllocator : public PixelAllocator {
+  public:
+    struct Stats {
+      size_t allocations = 0; // requests served by this pool
+      size_t reuses = 0; // requests served from the free list
+      size_t releases = 0; // buffers returned to this pool
+      size_t discards = 0; // returned buffers freed because the cache was full
+      size_t cached_buffers = 0;
+      size_t cached_bytes = 0;
+    };
+
+    PooledPixelAllocator(size_t _max_cached_bytes = 64 * 1024 * 1024, size_t _max_buffer_size = 32 * 1024 * 1024);
+    ~PooledPixelAllocator();
+    PooledPixelAllocator(const PooledPixelAllocator & other) = delete;
+    PooledPixelAllocator & operator=(const PooledPixelAllocator & other) = delete;
+
+    unsigned char * allocate(size_t size) override;
+    void deallocate(unsigned char * ptr, size_t size) override;
+
+    // Frees all cached buffers
+    void trim();
+
+    unsigned int getNumPools() const { return (unsigned int)pools.size(); }
+    size_t getPoolSize(unsigned int pool) const { return pools[pool].size; }
+    Stats getStats(unsigned int pool) const;
+    Stats getTotalStats() const;
+    void resetStats();
+
+    void setMaxCachedBytes(size_t n);
+    size_t getMaxCachedBytes() const { return max_cached_bytes; }
+    size_t getMaxBufferSize() const { return max_buffer_size; }
+
+  private:
+    struct Pool {
+      size_t size;
+      std::vector<unsigned char *> free_buffers;
+      Stats stats;
+    };
+
+    int getPool(size_t size) const;
+    void trim(size_t limit);
+
+    std::vector<Pool> pools;
+    size_t max_cached_bytes, max_buffer_size, cached_bytes = 0;
+    mutable std::mutex pool_mutex;
+  };
+
+  // Owns one block of pixel memory from a PixelAllocator
+  class PixelBuffer {
+  public:
+  PixelBuffer() : data(0), size(0), allocator(0) { }
+    // Set zero_fill to false when the caller writes every byte
+    PixelBuffer(size_t _size, bool zero_fill = true, PixelAllocator & _allocator = PixelAllocator::getDefault());
+    PixelBuffer(PixelBuffer && other) : data(other.data), size(other.size), allocator(other.allocator) {
+      other.data = 0;
+      other.size = 0;
+    }
+    PixelBuffer & operator=(PixelBuffer && other) {
+      if (this != &other) {
+	release();
+	data = other.data;
+	size = other.size;
+	allocator = other.allocator;
+	other.data = 0;
+	other.size = 0;
+      }
+      return *this;
+    }
+    PixelBuffer(const PixelBuffer & other) = delete;
+    PixelBuffer & operator=(const PixelBuffer & other) = delete;
+    ~PixelBuffer() { release(); }
+
+    unsigned char * get() { return data; }
+    const unsigned char * get() const { return data; }
+    size_t getSize() const { return size; }
+
+    void release() {
+      if (data) allocator->deallocate(data, size);
+      data = 0;
+      size = 0;
+    }
+
+  private:
+    unsigned char * data;
+    size_t size;
+    PixelAllocator * allocator;
+  };
+};
+
+#endif
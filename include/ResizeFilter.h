@@ -0,0 +1,24 @@
+#ifndef _RESIZEFILTER_H_
+#define _RESIZEFILTER_H_
+
+namespace canvas {
+  // Filters for ImageData::scale, matching the values of stbir_filter
+  enum ResizeFilter {
+    RESIZE_FILTER_DEFAULT = 0, // catmull-rom when enlarging, mitchell when reducing
+    RESIZE_FILTER_BOX, // box, or trapezoid for fractional ratios
+    RESIZE_FILTER_TRIANGLE, // bilinear when enlarging
+    RESIZE_FILTER_CUBIC_BSPLINE, // smooth, gaussian-like
+    RESIZE_FILTER_CATMULL_ROM, // sharp interpolating cubic
+    RESIZE_FILTER_MITCHELL // cubic between the two above
+  };
+
+  // How ImageData::scale samples outside the image, matching stbir_edge
+  enum ResizeEdge {
+    RESIZE_EDGE_CLAMP = 1,
+    RESIZE_EDGE_REFLECT,
+    RESIZE_EDGE_WRAP,
+    RESIZE_EDGE_ZERO
+  };
+};
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef _SHADOWCACHE_H_
+#define _SHADOWCACHE_H_
+
+#include <ImageData.h>
+#include <Path2D.h>
+#include <Font.h>
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+namespace canvas {
+  // Serializes everything that affects a shadow mask into a byte string
+  class ShadowCacheKey {
+  public:
+    ShadowCacheKey & add(double v) { return addBytes(&v, sizeof(v)); }
+    ShadowCacheKey & add(int v) { return addBytes(&v, sizeof(v)); }
+    ShadowCacheKey & add(const std::string & s) {
+      add(int(s.size()));
+      data += s;
+      return *this;
+    }
+    ShadowCacheKey & add(const Path2D & path) {
+      add(int(path.size()));
+      for (auto & pc : path.getData()) {
+	add(int(pc.type)).add(pc.x0).add(pc.y0).add(pc.radius).add(pc.sa).add(pc.ea).add(int(pc.anticlockwise));
+      }
+      return *this;
+    }
+    ShadowCacheKey & add(const Font & font) {
+      return add(font.family).add(double(font.size)).add(int(font.style)).add(int(font.weight.getValue())).add(int(font.variant)).add(int(font.antialiasing)).add(int(font.hinting));
+    }
+
+    const std::string & str() const { return data; }
+
+  private:
+    ShadowCacheKey & addBytes(const void * ptr, size_t n) {
+      data.append((const char *)ptr, n);
+      return *this;
+    }
+
+    std::string data;
+  };
+
+  // LRU cache of blurred R8 shadow masks limited by a byte budget
+  class ShadowCache {
+  public:
+    ShadowCache(size_t _budget = 4 * 1024 * 1024) : budget(_budget) { }
+    ShadowCache(const ShadowCache & other) = delete;
+    ShadowCache & operator=(const ShadowCache & other) = delete;
+
+    std::shared_ptr<ImageData> get(const ShadowCacheKey & key) {
+      auto it = index.find(key.str());
+      if (it == index.end()) {
+	misses++;
+	return std::shared_ptr<ImageData>();
+      }
+      hits++;
+      entries.splice(entries.begin(), entries, it->second);
+      return it->second->second;
+    }
+
+    void put(const ShadowCacheKey & key, const std::shared_ptr<ImageData> & mask) {
+      size_t s = mask->calculateSize();
+      if (s > budget || index.count(key.str())) return;
+      entries.push_front(std::make_pair(key.str(), mask));
+      index[key.str()] = entries.begin();
+      size += s;
+      evict(budget);
+    }
+
+    void clear() {
+      entries.clear();
+      index.clear();
+      size = 0;
+    }
+
+    void setBudget(size_t _budget) {
+      budget = _budget;
+      evict(budget);
+    }
+    size_t getBudget() const { return budget; }
+    size_t getSize() const { return size; }
+    size_t getNumEntries() const { return entries.size(); }
+
+    unsigned long long getHits() const { return hits; }
+    unsigned long long getMisses() const { return misses; }
+    unsigned long long getEvictions() const { return evictions; }
+    void resetCounters() { hits = misses = evictions = 0; }
+
+  private:
+    void evict(size_t limit) {
+      while (size > limit && !entries.empty()) {
+	size -= entries.back().second->calculateSize();
+	index.erase(entries.back().first);
+	entries.pop_back();
+	evictions++;
+      }
+    }
+
+    typedef std::list<std::pair<std::string, std::shared_ptr<ImageData> > > EntryList;
+
+    size_t budget, size = 0;
+    EntryList entries; // most recently used first
+    std::unordered_map<std::string, EntryList::iterator> index;
+    unsigned long long hits = 0, misses = 0, evictions = 0;
+  };
+};
+
+#endif
@@ -58,32 +58,61 @@ namespace canvas {
     virtual void drawImage(const ImageData & _img, const Point & p, double w, double h, float displayScale, float globalAlpha, float shadowBlur, float shadowOffsetX, float shadowOffsetY, const Color & shadowColor, const Path2D & clipPath, bool imageSmoothingEnabled = true) = 0;
     virtual std::unique_ptr<Image> createImage(float display_scale) = 0;
 
-    std::unique_ptr<PackedImageData> createPackedImage() {
+    // Packs the surface from its locked memory in one pass, without an
+    // intermediate copy. The options are in the order of the
+    // PackedImageData constructor. Without premultiplied_output, the
+    // color of four channel surfaces is divided by alpha while it is
+    // packed.
+    std::unique_ptr<PackedImageData> createPackedImage(InternalFormat format = RGBA8, unsigned int levels = 1, CompressionQuality quality = COMPRESSION_NORMAL, DitherMode dither = DITHER_FLOYD_STEINBERG, bool premultiplied_output = true, unsigned int num_threads = 1) {
       unsigned char * buffer = (unsigned char *)lockMemory(false);
       assert(buffer);
       if (buffer) {
-	std::unique_ptr<PackedImageData> image(new PackedImageData(RGBA8, getActualWidth(), getActualHeight(), 1, buffer));
+	std::unique_ptr<PackedImageData> image(new PackedImageData(format, levels, getView(buffer), quality, dither, premultiplied_output, false, num_threads));
 	releaseMemory();
 	return image;
       } else {
-	return std::unique_ptr<PackedImageData>(new PackedImageData(RGBA8, getActualWidth(), getActualHeight(), 1));
+	return std::unique_ptr<PackedImageData>(new PackedImageData(format, getActualWidth(), getActualHeight(), levels));
       }
     }
 
-    std::unique_ptr<ImageData> blur(float hradius, float vradius) {
-      ImageData tmp((unsigned char *)lockMemory(false), getActualWidth(), getActualHeight(), getNumChannels());
-      auto r = tmp.blur(hradius, vradius);
+    // num_threads = 0 uses all hardware threads
+    std::unique_ptr<ImageData> blur(float hradius, float vradius, BlurMode mode = KERNEL_BLUR, unsigned int num_threads = 1, float pyramid_threshold = BLUR_PYRAMID_THRESHOLD) {
+      auto r = ImageData::blur(getView(lockMemory(false)), hradius, vradius, mode, num_threads, pyramid_threshold);
       releaseMemory();
       return r;
     }
     
     std::unique_ptr<ImageData> colorize(const Color & color) {
-      ImageData tmp((unsigned char *)lockMemory(false), getActualWidth(), getActualHeight(), getNumChannels());
-      auto r = tmp.colorize(color);
+      auto r = ImageData::colorize(getView(lockMemory(false)), color);
       releaseMemory();
       return r;
     }
 
+    // Writes a one channel mask colorized to this four channel surface
+    void colorizeMask(const ImageData & mask, const Color & color) {
+      assert(getNumChannels() == 4 && mask.getNumChannels() == 1);
+      assert(mask.getWidth() == getActualWidth() && mask.getHeight() == getActualHeight());
+      unsigned char * buffer = (unsigned char *)lockMemory(true);
+      mask.colorize(color, buffer, getBytesPerRow());
+      releaseMemory();
+    }
+
+    // Blurs this one channel surface and writes the result colorized
+    // to a four channel surface of the same size in a single operation
+    void blurColorize(Surface & target, float hradius, float vradius, const Color & color, BlurMode mode = KERNEL_BLUR, unsigned int num_threads = 1, float pyramid_threshold = BLUR_PYRAMID_THRESHOLD) {
+      assert(getNumChannels() == 1 && target.getNumChannels() == 4);
+      assert(getActualWidth() == target.getActualWidth() && getActualHeight() == target.getActualHeight());
+      const unsigned char * input = (const unsigned char *)lockMemory(false);
+      unsigned char * output = (unsigned char *)target.lockMemory(true);
+      ImageData::blurColorize(input, getBytesPerRow(), getActualWidth(), getActualHeight(), hradius, vradius, color, output, target.getBytesPerRow(), mode, num_threads, pyramid_threshold);
+      target.releaseMemory();
+      releaseMemory();
+    }
+
+    virtual size_t getBytesPerRow() const { return size_t(actual_width) * num_channels; }
+    // Tells whether four channel pixels are stored in BGRA byte order
+    virtual bool isBGRA() const { return false; }
+
     unsigned int getLogicalWidth() const { return logical_width; }
     unsigned int getLogicalHeight() const { return logical_height; }
     unsigned int getActualWidth() const { return actual_width; }
@@ -94,6 +123,11 @@ namespace canvas {
     virtual void * lockMemory(bool write_access = false) = 0;
     virtual void releaseMemory() = 0;
 
+    // View of locked memory, valid until releaseMemory() is called
+    ImageDataView getView(const void * buffer) const {
+      return ImageDataView((const unsigned char *)buffer, getActualWidth(), getActualHeight(), getNumChannels(), getBytesPerRow(), true, isBGRA());
+    }
+
   private:
     unsigned int logical_width, logical_height, actual_width, actual_height, num_channels;
   };
@@ -1,5 +1,7 @@
 #include "ContextAndroid.h"
 
+#include "PackPixel.h"
+
 #include <errno.h>
 #include <cassert>
 
@@ -230,15 +232,8 @@ AndroidSurface::imageToBitmap(const ImageData & img) {
   if (img.getNumChannels() == 4) {
     env->SetIntArrayRegion(jarray, 0, n, (const jint*)img.getData());
   } else {
-    const unsigned char * input_data = img.getData();
     unique_ptr<unsigned int[]> tmp(new unsigned int[n]);
-    for (unsigned int i = 0; i < n; i++) {
-      unsigned char r = *input_data++;
-      unsigned char g = img.getNumChannels() >= 2 ? *input_data++ : r;
-      unsigned char b = img.getNumChannels() >= 3 ? *input_data++ : g;
-      unsigned char a = img.getNumChannels() >= 4 ? *input_data++ : 0xff;
-      tmp[i] = (r) | (g << 8) | (b << 16) | (a << 24);
-    }
+    expand_to_rgba32_span(img.getData(), img.getNumChannels(), tmp.get(), n);
     env->SetIntArrayRegion(jarray, 0, n, (const jint*)tmp.get());
   }
   jobject argbObject = createBitmapConfig(4);
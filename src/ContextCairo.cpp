@@ -1,5 +1,7 @@
 #include <ContextCairo.h>
 
+#include "PackPixel.h"
+
 #include <cassert>
 #include <cmath>
 #include <iostream>
@@ -21,27 +23,27 @@ static cairo_format_t getCairoFormat(unsigned int num_channels) {
 
 static pair<cairo_surface_t *, unsigned int *> initializeSurfaceFromData(unsigned int width, unsigned int height, unsigned int num_channels, const unsigned char * data, bool flip_channels) {
   cairo_format_t format = getCairoFormat(num_channels);
-  unsigned int stride = cairo_format_stride_for_width(format, width);
-  size_t numPixels = width * height;
+  size_t stride = cairo_format_stride_for_width(format, width);
+  size_t numPixels = size_t(width) * height;
   unsigned int * storage;
   if (num_channels == 1) {
-    storage = new unsigned int[(numPixels + 3) / 4];
-    memcpy(storage, data, numPixels);  
+    // A8 rows are padded to a multiple of four bytes
+    storage = new unsigned int[(stride * height + 3) / 4];
+    for (unsigned int row = 0; row < height; row++) {
+      memcpy((unsigned char *)storage + row * stride, data + size_t(row) * width, width);
+    }
   } else {
     storage = new unsigned int[numPixels];
-    assert(stride == 4 * width);
+    assert(stride == 4 * size_t(width));
     if (num_channels == 4) {
       if (flip_channels) {
-	for (unsigned int i = 0; i < numPixels; i++) {
-	  storage[i] = (data[4 * i + 2]) | (data[4 * i + 1] << 8) | (data[4 * i + 0] << 16) | (data[4 * i + 3] << 24);
-	}
+	swap_red_blue_span((const unsigned int *)data, storage, numPixels);
       } else {
 	memcpy(storage, data, numPixels * 4);
       }
     } else if (num_channels == 3) {
-      for (unsigned int i = 0; i < numPixels; i++) {
-	storage[i] = data[3 * i + 2] + (data[3 * i + 1] << 8) + (data[3 * i + 0] << 16);
-      }
+      // RGB24 ignores the alpha byte
+      expand_rgb_to_bgra32_span(data, storage, numPixels);
     } else {
       assert(0);
     }
@@ -0,0 +1,106 @@
+#include "Convolution.h"
+
+#include "CpuFeatures.h"
+
+using namespace canvas;
+
+static void convolve_span_scalar(const unsigned char * input, unsigned char * output, size_t n, size_t step, const short * weights, unsigned int taps) {
+  for (size_t j = 0; j < n; j++) {
+    int c = 1 << (CONVOLUTION_SHIFT - 1);
+    const unsigned char * ptr = input + j;
+    for (unsigned int i = 0; i < taps; i++, ptr += step) {
+      c += *ptr * weights[i];
+    }
+    output[j] = (unsigned char)(c >> CONVOLUTION_SHIFT);
+  }
+}
+
+#ifdef CANVAS_HAS_X86
+// Taps are processed in pairs: the bytes of two taps are interleaved
+// as 16-bit values so that madd multiplies and sums both at once.
+CANVAS_TARGET("sse2")
+static void convolve_span_sse2(const unsigned char * input, unsigned char * output, size_t n, size_t step, const short * weights, unsigned int taps) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi32(1 << (CONVOLUTION_SHIFT - 1));
+  size_t j = 0;
+  for (; j + 16 <= n; j += 16) {
+    __m128i acc0 = round, acc1 = round, acc2 = round, acc3 = round;
+    const unsigned char * ptr = input + j;
+    for (unsigned int i = 0; i < taps; i += 2, ptr += 2 * step) {
+      __m128i a = _mm_loadu_si128((const __m128i *)ptr), b, w;
+      if (i + 1 < taps) {
+	b = _mm_loadu_si128((const __m128i *)(ptr + step));
+	w = _mm_set1_epi32((unsigned short)weights[i] | ((unsigned int)(unsigned short)weights[i + 1] << 16));
+      } else {
+	b = zero;
+	w = _mm_set1_epi32((unsigned short)weights[i]);
+      }
+      __m128i a_lo = _mm_unpacklo_epi8(a, zero), a_hi = _mm_unpackhi_epi8(a, zero);
+      __m128i b_lo = _mm_unpacklo_epi8(b, zero), b_hi = _mm_unpackhi_epi8(b, zero);
+      acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(a_lo, b_lo), w));
+      acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(a_lo, b_lo), w));
+      acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi16(a_hi, b_hi), w));
+      acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi16(a_hi, b_hi), w));
+    }
+    acc0 = _mm_srai_epi32(acc0, CONVOLUTION_SHIFT);
+    acc1 = _mm_srai_epi32(acc1, CONVOLUTION_SHIFT);
+    acc2 = _mm_srai_epi32(acc2, CONVOLUTION_SHIFT);
+    acc3 = _mm_srai_epi32(acc3, CONVOLUTION_SHIFT);
+    __m128i r = _mm_packus_epi16(_mm_packs_epi32(acc0, acc1), _mm_packs_epi32(acc2, acc3));
+    _mm_storeu_si128((__m128i *)(output + j), r);
+  }
+  convolve_span_scalar(input + j, output + j, n - j, step, weights, taps);
+}
+
+// Same as the SSE2 version with 32 bytes at a time. Unpacking and
+// packing both work within 128-bit lanes, so the byte order is kept.
+CANVAS_TARGET("avx2")
+static void convolve_span_avx2(const unsigned char * input, unsigned char * output, size_t n, size_t step, const short * weights, unsigned int taps) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i round = _mm256_set1_epi32(1 << (CONVOLUTION_SHIFT - 1));
+  size_t j = 0;
+  for (; j + 32 <= n; j += 32) {
+    __m256i acc0 = round, acc1 = round, acc2 = round, acc3 = round;
+    const unsigned char * ptr = input + j;
+    for (unsigned int i = 0; i < taps; i += 2, ptr += 2 * step) {
+      __m256i a = _mm256_loadu_si256((const __m256i *)ptr), b, w;
+      if (i + 1 < taps) {
+	b = _mm256_loadu_si256((const __m256i *)(ptr + step));
+	w = _mm256_set1_epi32((unsigned short)weights[i] | ((unsigned int)(unsigned short)weights[i + 1] << 16));
+      } else {
+	b = zero;
+	w = _mm256_set1_epi32((unsigned short)weights[i]);
+      }
+      __m256i a_lo = _mm256_unpacklo_epi8(a, zero), a_hi = _mm256_unpackhi_epi8(a, zero);
+      __m256i b_lo = _mm256_unpacklo_epi8(b, zero), b_hi = _mm256_unpackhi_epi8(b, zero);
+      acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(a_lo, b_lo), w));
+      acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(a_lo, b_lo), w));
+      acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi16(a_hi, b_hi), w));
+      acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi16(a_hi, b_hi), w));
+    }
+    acc0 = _mm256_srai_epi32(acc0, CONVOLUTION_SHIFT);
+    acc1 = _mm256_srai_epi32(acc1, CONVOLUTION_SHIFT);
+    acc2 = _mm256_srai_epi32(acc2, CONVOLUTION_SHIFT);
+    acc3 = _mm256_srai_epi32(acc3, CONVOLUTION_SHIFT);
+    __m256i r = _mm256_packus_epi16(_mm256_packs_epi32(acc0, acc1), _mm256_packs_epi32(acc2, acc3));
+    _mm256_storeu_si256((__m256i *)(output + j), r);
+  }
+  convolve_span_sse2(input + j, output + j, n - j, step, weights, taps);
+}
+#endif
+
+typedef void (*convolve_span_func)(const unsigned char * input, unsigned char * output, size_t n, size_t step, const short * weights, unsigned int taps);
+
+static convolve_span_func select_convolve_span() {
+#ifdef CANVAS_HAS_X86
+  if (CpuFeatures::hasAVX2()) return convolve_span_avx2;
+  if (CpuFeatures::hasSSE2()) return convolve_span_sse2;
+#endif
+  return convolve_span_scalar;
+}
+
+void
+canvas::convolve_span(const unsigned char * input, unsigned char * output, size_t n, size_t step, const short * weights, unsigned int taps) {
+  static convolve_span_func f = select_convolve_span();
+  f(input, output, n, step, weights, taps);
+}
@@ -0,0 +1,17 @@
+#ifndef _CONVOLUTION_H_
+#define _CONVOLUTION_H_
+
+#include <cstddef>
+
+// Fixed-point weights are scaled so that they sum to 1 << CONVOLUTION_SHIFT
+#define CONVOLUTION_SHIFT 14
+
+namespace canvas {
+  // Computes output[j] = sum(input[j + i * step] * weights[i]) >> CONVOLUTION_SHIFT
+  // (rounded) for j in [0, n). A horizontal pass uses the pixel size as
+  // step and a vertical pass the row size. The best available
+  // instruction set is selected at runtime.
+  void convolve_span(const unsigned char * input, unsigned char * output, size_t n, size_t step, const short * weights, unsigned int taps);
+};
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef _CPUFEATURES_H_
+#define _CPUFEATURES_H_
+
+// Runtime detection of the instruction sets used by the SIMD kernels.
+// Define CANVAS_NO_SIMD to force the scalar fallbacks.
+
+#if !defined CANVAS_NO_SIMD && (defined __x86_64__ || defined __i386__ || defined _M_X64 || defined _M_IX86)
+#define CANVAS_HAS_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined CANVAS_HAS_X86 && (defined __GNUC__ || defined __clang__)
+#define CANVAS_TARGET(x) __attribute__((target(x)))
+#else
+#define CANVAS_TARGET(x)
+#endif
+
+namespace canvas {
+  class CpuFeatures {
+  public:
+    static bool hasSSE2() { return get().sse2; }
+    static bool hasSSSE3() { return get().ssse3; }
+    static bool hasSSE41() { return get().sse41; }
+    static bool hasAVX2() { return get().avx2; }
+
+  private:
+    CpuFeatures() {
+#ifdef CANVAS_HAS_X86
+#ifdef _MSC_VER
+      int info[4];
+      __cpuid(info, 0);
+      int n = info[0];
+      __cpuid(info, 1);
+      sse2 = (info[3] & (1 << 26)) != 0;
+      ssse3 = (info[2] & (1 << 9)) != 0;
+      sse41 = (info[2] & (1 << 19)) != 0;
+      bool osxsave = (info[2] & (1 << 27)) != 0;
+      if (n >= 7 && osxsave && (_xgetbv(0) & 6) == 6) {
+	__cpuidex(info, 7, 0);
+	avx2 = (info[1] & (1 << 5)) != 0;
+      }
+#else
+      __builtin_cpu_init();
+      sse2 = __builtin_cpu_supports("sse2");
+      ssse3 = __builtin_cpu_supports("ssse3");
+      sse41 = __builtin_cpu_supports("sse4.1");
+      avx2 = __builtin_cpu_supports("avx2");
+#endif
+#endif
+    }
+
+    static const CpuFeatures & get() {
+      static CpuFeatures features;
+      return features;
+    }
+
+    bool sse2 = false, ssse3 = false, sse41 = false, avx2 = false;
+  };
+};
+
+#endif
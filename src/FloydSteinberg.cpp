@@ -1,191 +1,238 @@
 #include "FloydSteinberg.h"
 
 #include <ImageData.h>
-#include <ImageFormat.h>
+#include <PixelBuffer.h>
 
+#include "CpuFeatures.h"
+#include "PackPixel.h"
+#include "Parallel.h"
+
+#include <atomic>
 #include <cassert>
-#include <vector>
 
 using namespace std;
 using namespace canvas;
 
-struct rgba_s {
-  rgba_s() : red(0), green(0), blue(0), alpha(0) { }
-  rgba_s(unsigned int _red, unsigned int _green, unsigned int _blue, unsigned int _alpha = 0) : red(_red), green(_green), blue(_blue), alpha(_alpha) { }
-  unsigned int red;
-  unsigned int green;
-  unsigned int blue;
-  unsigned int alpha;
-
-  inline void setError(unsigned int weight, unsigned int error) {
-    red = (weight * RGBA_TO_RED(error)) >> 4;
-    green = (weight * RGBA_TO_GREEN(error)) >> 4;
-    blue = (weight * RGBA_TO_BLUE(error)) >> 4;
-  }
+// Pixels that a row processes between synchronizations with the row
+// below in the multithreaded wavefront
+#define FS_WAVEFRONT_STEP 256
+// Smallest image in pixels that is dithered with several threads
+#define FS_MIN_PARALLEL_SIZE (256 * 1024)
 
-  inline void addError(unsigned int weight, unsigned int error) {
-    red += (weight * RGBA_TO_RED(error)) >> 4;
-    green += (weight * RGBA_TO_GREEN(error)) >> 4;
-    blue += (weight * RGBA_TO_BLUE(error)) >> 4;
-  }
+// The error rows hold four 16-bit channels for each of width + 2
+// pixels. A single row is enough: pixel x reads the error of the row
+// above from entry x + 1 before the entry x it writes, which was last
+// read by pixel x - 1. Each pixel passes 7/16 of its quantization
+// error to the right and 3/16, 5/16 and 1/16 to the row below. The
+// shares are truncated separately, so the sums stay identical to
+// distributing them one by one.
 
-  inline void setErrorAlpha(unsigned int weight, unsigned int error) {
-    red = (weight * RGBA_TO_RED(error)) >> 4;
-    green = (weight * RGBA_TO_GREEN(error)) >> 4;
-    blue = (weight * RGBA_TO_BLUE(error)) >> 4;
-    alpha = (weight * RGBA_TO_ALPHA(error)) >> 4;
-  }
+// Error carried between the pixels of a row: next for the pixel to the
+// right, below0 and below1 the parts of entries x and x + 1 received
+// from earlier pixels. Rows can be processed in pieces by passing the
+// state on.
+struct fs_state_s {
+  unsigned short next[4] = { 0, 0, 0, 0 }, below0[4] = { 0, 0, 0, 0 }, below1[4] = { 0, 0, 0, 0 };
+};
 
-  inline void addErrorAlpha(unsigned int weight, unsigned int error) {
-    red += (weight * RGBA_TO_RED(error)) >> 4;
-    green += (weight * RGBA_TO_GREEN(error)) >> 4;
-    blue += (weight * RGBA_TO_BLUE(error)) >> 4;
-    alpha += (weight * RGBA_TO_ALPHA(error)) >> 4;
+struct fs_error_s {
+  fs_error_s(const unsigned short * v) : red(v[0]), green(v[1]), blue(v[2]), alpha(v[3]) { }
+  void store(unsigned short * v) const {
+    v[0] = (unsigned short)red;
+    v[1] = (unsigned short)green;
+    v[2] = (unsigned short)blue;
+    v[3] = (unsigned short)alpha;
   }
+  unsigned int red, green, blue, alpha;
 };
 
-static unsigned int apply2(unsigned int * input_data, unsigned int width, unsigned int height, InternalFormat target_format, unsigned char * output_data, unsigned int bytesPerRow) {
-  unsigned int * input = input_data;
-
-  if (target_format == RGBA4) {
-    vector<rgba_s> old_errors(width + 2);
-    for (unsigned int y = 0; y < height; y++) {
-      vector<rgba_s> new_errors(width + 2);
-      rgba_s next_error;
-      unsigned short * output_row = (unsigned short *)(output_data + y * bytesPerRow);
-      for (unsigned int x = 0; x < width; x++, input++) {
-        unsigned int v0 = *input;
-        unsigned int red = RGBA_TO_RED(v0) + next_error.red + old_errors[x + 1].red;
-        unsigned int green = RGBA_TO_GREEN(v0) + next_error.green + old_errors[x + 1].green;
-        unsigned int blue = RGBA_TO_BLUE(v0) + next_error.blue + old_errors[x + 1].blue;
-        unsigned int alpha = RGBA_TO_ALPHA(v0) + next_error.alpha + old_errors[x + 1].alpha;
-        if (red > 255) red = 255;
-        if (green > 255) green = 255;
-        if (blue > 255) blue = 255;
-        if (alpha > 255) alpha = 255;
-        unsigned int v = PACK_RGBA32(red, green, blue, alpha);
-        unsigned int error = v & 0x0f0f0f0f;
-#if defined __APPLE__ || defined __ANDROID__
-        *output_row++ = ((RGBA_TO_RED(v) >> 4) << 12) | ((RGBA_TO_GREEN(v) >> 4) << 8) | ((RGBA_TO_BLUE(v) >> 4) << 4) | (RGBA_TO_ALPHA(v) >> 4);
-#else
-        *output_row++ = ((RGBA_TO_BLUE(v) >> 4) << 12) | ((RGBA_TO_GREEN(v) >> 4) << 8) | ((RGBA_TO_RED(v) >> 4) << 4) | (RGBA_TO_ALPHA(v) >> 4);
+// Dithers pixels [begin, end) of a row. The last piece also completes
+// the entries past the end of the row.
+template<InternalFormat F>
+static void dither_row(const unsigned int * input, unsigned short * output, unsigned short * errors, unsigned int begin, unsigned int end, unsigned int width, fs_state_s & state) {
+  const unsigned int mask = packed_error_mask<F>();
+  const bool has_alpha = F == RGBA4 || F == RGBA5551;
+  fs_error_s next(state.next), below0(state.below0), below1(state.below1);
+  for (unsigned int x = begin; x < end; x++) {
+    unsigned int v0 = input[x];
+    const unsigned short * above = errors + 4 * (x + 1);
+    unsigned int red = RGBA_TO_RED(v0) + next.red + above[0];
+    unsigned int green = RGBA_TO_GREEN(v0) + next.green + above[1];
+    unsigned int blue = RGBA_TO_BLUE(v0) + next.blue + above[2];
+    unsigned int alpha = has_alpha ? RGBA_TO_ALPHA(v0) + next.alpha + above[3] : 0;
+    if (red > 255) red = 255;
+    if (green > 255) green = 255;
+    if (blue > 255) blue = 255;
+    if (alpha > 255) alpha = 255;
+    unsigned int v = PACK_RGBA32(red, green, blue, alpha);
+    output[x] = pack_rgba32<F>(v);
+    unsigned int error = v & mask;
+    unsigned int er = RGBA_TO_RED(error), eg = RGBA_TO_GREEN(error), eb = RGBA_TO_BLUE(error), ea = has_alpha ? RGBA_TO_ALPHA(error) : 0;
+    unsigned short * below = errors + 4 * x;
+    below[0] = (unsigned short)(((3 * er) >> 4) + below0.red);
+    below[1] = (unsigned short)(((3 * eg) >> 4) + below0.green);
+    below[2] = (unsigned short)(((3 * eb) >> 4) + below0.blue);
+    below[3] = (unsigned short)(((3 * ea) >> 4) + below0.alpha);
+    below0.red = ((5 * er) >> 4) + below1.red;
+    below0.green = ((5 * eg) >> 4) + below1.green;
+    below0.blue = ((5 * eb) >> 4) + below1.blue;
+    below0.alpha = ((5 * ea) >> 4) + below1.alpha;
+    below1.red = er >> 4;
+    below1.green = eg >> 4;
+    below1.blue = eb >> 4;
+    below1.alpha = ea >> 4;
+    next.red = (7 * er) >> 4;
+    next.green = (7 * eg) >> 4;
+    next.blue = (7 * eb) >> 4;
+    next.alpha = (7 * ea) >> 4;
+  }
+  if (end == width) {
+    below0.store(errors + 4 * width);
+    below1.store(errors + 4 * width + 4);
+  }
+  next.store(state.next);
+  below0.store(state.below0);
+  below1.store(state.below1);
+}
+
+#ifdef CANVAS_HAS_X86
+// The four channels of a pixel are processed together in 16-bit lanes.
+// Only the pixels depend on each other, through the error passed right.
+template<InternalFormat F>
+CANVAS_TARGET("sse2")
+static void dither_row_sse2(const unsigned int * input, unsigned short * output, unsigned short * errors, unsigned int begin, unsigned int end, unsigned int width, fs_state_s & state) {
+  const unsigned int m = packed_error_mask<F>();
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i mask = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)m), zero);
+  const __m128i max_value = _mm_set1_epi16(255);
+  const __m128i w7 = _mm_set1_epi16(7);
+  const __m128i w35 = _mm_set_epi16(5, 5, 5, 5, 3, 3, 3, 3);
+  __m128i next = _mm_loadl_epi64((const __m128i *)state.next);
+  __m128i below0 = _mm_loadl_epi64((const __m128i *)state.below0);
+  __m128i below1 = _mm_loadl_epi64((const __m128i *)state.below1);
+  for (unsigned int x = begin; x < end; x++) {
+    __m128i pixel = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)input[x]), zero);
+    __m128i above = _mm_loadl_epi64((const __m128i *)(errors + 4 * (x + 1)));
+    __m128i value = _mm_min_epi16(_mm_add_epi16(_mm_add_epi16(pixel, next), above), max_value);
+    output[x] = pack_rgba32<F>((unsigned int)_mm_cvtsi128_si32(_mm_packus_epi16(value, value)));
+    __m128i e = _mm_and_si128(value, mask);
+    next = _mm_srli_epi16(_mm_mullo_epi16(e, w7), 4);
+    // 3/16 in the low and 5/16 in the high half
+    __m128i e35 = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi64(e, e), w35), 4);
+    _mm_storel_epi64((__m128i *)(errors + 4 * x), _mm_add_epi16(e35, below0));
+    below0 = _mm_add_epi16(_mm_srli_si128(e35, 8), below1);
+    below1 = _mm_srli_epi16(e, 4);
+  }
+  if (end == width) {
+    _mm_storel_epi64((__m128i *)(errors + 4 * width), below0);
+    _mm_storel_epi64((__m128i *)(errors + 4 * width + 4), below1);
+  }
+  _mm_storel_epi64((__m128i *)state.next, next);
+  _mm_storel_epi64((__m128i *)state.below0, below0);
+  _mm_storel_epi64((__m128i *)state.below1, below1);
+}
 #endif
-        next_error.setErrorAlpha(7, error);
-        new_errors[x].addErrorAlpha(3, error);
-        new_errors[x + 1].addErrorAlpha(5, error);
-        new_errors[x + 2].addErrorAlpha(1, error);
-      }
-      old_errors.swap(new_errors);
-    }
-  } else if (target_format == RGBA5551) {
-    vector<rgba_s> old_errors(width + 2);
-    for (unsigned int y = 0; y < height; y++) {
-      vector<rgba_s> new_errors(width + 2);
-      rgba_s next_error;
-      unsigned short * output_row = (unsigned short *)(output_data + y * bytesPerRow);
-      for (unsigned int x = 0; x < width; x++, input++) {
-        unsigned int v0 = *input;
-        unsigned int red = RGBA_TO_RED(v0) + next_error.red + old_errors[x + 1].red;
-        unsigned int green = RGBA_TO_GREEN(v0) + next_error.green + old_errors[x + 1].green;
-        unsigned int blue = RGBA_TO_BLUE(v0) + next_error.blue + old_errors[x + 1].blue;
-        unsigned int alpha = RGBA_TO_ALPHA(v0) + next_error.alpha + old_errors[x + 1].alpha;
-        if (red > 255) red = 255;
-        if (green > 255) green = 255;
-        if (blue > 255) blue = 255;
-        if (alpha > 255) alpha = 255;
-        unsigned int v = PACK_RGBA32(red, green, blue, alpha);
-        unsigned int error = v & 0x7f070707;
-        *output_row++ = PACK_RGBA5551(RGBA_TO_BLUE(v) >> 3, RGBA_TO_GREEN(v) >> 3, RGBA_TO_RED(v) >> 3, RGBA_TO_ALPHA(v) >> 7);
-        next_error.setErrorAlpha(7, error);
-        new_errors[x].addErrorAlpha(3, error);
-        new_errors[x + 1].addErrorAlpha(5, error);
-        new_errors[x + 2].addErrorAlpha(1, error);
-      }
-      old_errors.swap(new_errors);
-    }
-  } else if (target_format == RGB555) {
-    vector<rgba_s> old_errors(width + 2);
-    for (unsigned int y = 0; y < height; y++) {
-      vector<rgba_s> new_errors(width + 2);
-      rgba_s next_error;
-      unsigned short * output_row = (unsigned short *)(output_data + y * bytesPerRow);
-      for (unsigned int x = 0; x < width; x++) {
-	unsigned int v0 = *input++;
-	unsigned int red = RGBA_TO_RED(v0) + next_error.red + old_errors[x + 1].red;
-	unsigned int green = RGBA_TO_GREEN(v0) + next_error.green + old_errors[x + 1].green;
-	unsigned int blue = RGBA_TO_BLUE(v0) + next_error.blue + old_errors[x + 1].blue;
-	if (red > 255) red = 255;
-	if (green > 255) green = 255;
-	if (blue > 255) blue = 255;
-	unsigned int v = PACK_RGB24(red, green, blue);
-	unsigned int error = v & 0x00070707;
-	*output_row++ = PACK_RGB555(RGBA_TO_BLUE(v) >> 3, RGBA_TO_GREEN(v) >> 3, RGBA_TO_RED(v) >> 3);
-        
-	next_error.setError(7, error);
-	new_errors[x].addError(3, error);
-	new_errors[x + 1].addError(5, error);
-	new_errors[x + 2].addError(1, error);
-      }
-      old_errors.swap(new_errors);
-    }
-  } else {
-    vector<rgba_s> old_errors(width + 2);
-    for (unsigned int y = 0; y < height; y++) {
-      vector<rgba_s> new_errors(width + 2);
-      rgba_s next_error;
-      unsigned short * output_row = (unsigned short *)(output_data + y * bytesPerRow);
-      for (unsigned int x = 0; x < width; x++, input++) {
-        unsigned int v0 = *input;
-        unsigned int red = RGBA_TO_RED(v0) + next_error.red + old_errors[x + 1].red;
-        unsigned int green = RGBA_TO_GREEN(v0) + next_error.green + old_errors[x + 1].green;
-        unsigned int blue = RGBA_TO_BLUE(v0) + next_error.blue + old_errors[x + 1].blue;
-        if (red > 255) red = 255;
-        if (green > 255) green = 255;
-        if (blue > 255) blue = 255;
-        unsigned int v = PACK_RGB24(red, green, blue);
-        unsigned int error = v & 0x00070307;
-#if defined __APPLE__ || defined __ANDROID__
-        *output_row++ = PACK_RGB565(RGBA_TO_BLUE(v) >> 3, RGBA_TO_GREEN(v) >> 2, RGBA_TO_RED(v) >> 3);
-#else
-        *output_row++ = PACK_RGB565(RGBA_TO_RED(v) >> 3, RGBA_TO_GREEN(v) >> 2, RGBA_TO_BLUE(v) >> 3);
+
+typedef void (*dither_row_func)(const unsigned int * input, unsigned short * output, unsigned short * errors, unsigned int begin, unsigned int end, unsigned int width, fs_state_s & state);
+
+template<InternalFormat F>
+static dither_row_func select_dither_row() {
+#ifdef CANVAS_HAS_X86
+  if (CpuFeatures::hasSSE2()) return dither_row_sse2<F>;
 #endif
-        next_error.setError(7, error);
-        new_errors[x].addError(3, error);
-        new_errors[x + 1].addError(5, error);
-        new_errors[x + 2].addError(1, error);
-      }
-      old_errors.swap(new_errors);
-    }
+  return dither_row<F>;
+}
+
+static dither_row_func get_dither_row(InternalFormat format) {
+  static dither_row_func rgba4 = select_dither_row<RGBA4>();
+  static dither_row_func rgba5551 = select_dither_row<RGBA5551>();
+  static dither_row_func rgb555 = select_dither_row<RGB555>();
+  static dither_row_func rgb565 = select_dither_row<RGB565>();
+  switch (format) {
+  case RGBA4: return rgba4;
+  case RGBA5551: return rgba5551;
+  case RGB555: return rgb555;
+  default: return rgb565;
   }
-  return width * height * 2;
 }
 
-unsigned int
-FloydSteinberg::apply(const ImageData & input_image, unsigned char * output, unsigned int bytesPerRow) const {
+size_t
+FloydSteinberg::apply(const ImageDataView & input_image, unsigned char * output, size_t bytesPerRow, PixelBuffer & state) const {
   unsigned int width = input_image.getWidth();
   unsigned int height = input_image.getHeight();
+  assert(input_image.getNumChannels() == 4 || input_image.getNumChannels() == 3 || input_image.getNumChannels() == 1);
 
-  auto data = input_image.getData();
-  
-  if (input_image.getNumChannels() == 4) {
-    return apply2((unsigned int *)data, width, height, target_format, output, bytesPerRow);
-  } else {
-    auto input_data = std::unique_ptr<unsigned int[]>(new unsigned int[width * height]);
-    auto tmp = input_data.get();
-
-    if (input_image.getNumChannels() == 3) {
-      unsigned int n = 3 * width * height;
-      for (unsigned int offset = 0; offset < n; offset += 3) {
-	*tmp++ = (0xff << 24) | (data[offset + 2] << 16) | (data[offset + 1] << 8) | (data[offset + 0]);
-      }
-    } else if (input_image.getNumChannels() == 1) {
-      unsigned int n = width * height;
-      for (unsigned int offset = 0; offset < n; offset++) {
-	unsigned char v = data[offset];
-	*tmp++ = (0xff << 24) | (v << 16) | (v << 8) | (v);
-      }
-    }
+  // the error row, followed by a converted row for input that is not
+  // RGBA32 as is
+  size_t errors_size = (size_t(width) + 2) * 4 * sizeof(unsigned short);
+  size_t converted_size = needs_rgba32_conversion(input_image, unpremultiply) ? size_t(width) * 4 : 0;
+  if (!state.getSize()) {
+    state = PixelBuffer(errors_size + converted_size, false);
+    memset(state.get(), 0, errors_size);
+  }
+  assert(state.getSize() == errors_size + converted_size);
+  unsigned short * errors = (unsigned short *)state.get();
+  unsigned int * converted = (unsigned int *)(state.get() + errors_size);
 
-    return apply2(input_data.get(), width, height, target_format, output, bytesPerRow);
+  dither_row_func f = get_dither_row(target_format);
+  for (unsigned int row = 0; row < height; row++) {
+    fs_state_s row_state;
+    f(get_rgba32_row(input_image, row, converted, unpremultiply), (unsigned short *)(output + row * bytesPerRow), errors, 0, width, width, row_state);
   }
+  return size_t(width) * height * 2;
+}
+
+size_t
+FloydSteinberg::apply(const ImageDataView & input_image, unsigned char * output, size_t bytesPerRow, unsigned int num_threads) const {
+  unsigned int width = input_image.getWidth();
+  unsigned int height = input_image.getHeight();
+  assert(input_image.getNumChannels() == 4 || input_image.getNumChannels() == 3 || input_image.getNumChannels() == 1);
+
+  num_threads = get_num_threads(num_threads);
+  if (num_threads > height) num_threads = height;
+  if (size_t(width) * height < FS_MIN_PARALLEL_SIZE || width < 2 * FS_WAVEFRONT_STEP) num_threads = 1;
+  if (num_threads <= 1) {
+    PixelBuffer state;
+    return apply(input_image, output, bytesPerRow, state);
+  }
+
+  dither_row_func f = get_dither_row(target_format);
+
+  // one error row and, for input that is not RGBA32 as is, one converted row per thread
+  size_t errors_size = (size_t(width) + 2) * 4 * sizeof(unsigned short);
+  size_t converted_size = needs_rgba32_conversion(input_image, unpremultiply) ? size_t(width) * 4 : 0;
+  PixelBuffer buffer(errors_size + num_threads * converted_size, false);
+  unsigned short * errors = (unsigned short *)buffer.get();
+  memset(errors, 0, errors_size);
+
+  // Wavefront: the threads take every num_threads'th row and follow
+  // the row above in steps. Pixel x reads the entries up to x + 1 that
+  // the row above completes at its pixel x + 1, and the entries it
+  // overwrites have already been read by that row, so the rows share
+  // the error row in place and the result equals the serial one.
+  unique_ptr<atomic<unsigned int>[]> progress(new atomic<unsigned int>[height]);
+  for (unsigned int row = 0; row < height; row++) progress[row].store(0, memory_order_relaxed);
+
+  // one range per thread, so begin is the thread index
+  parallel_for(num_threads, num_threads, [&](unsigned int begin, unsigned int) {
+      unsigned int * converted = (unsigned int *)(buffer.get() + errors_size + begin * converted_size);
+      for (unsigned int row = begin; row < height; row += num_threads) {
+	const unsigned int * input = get_rgba32_row(input_image, row, converted, unpremultiply);
+	unsigned short * output_row = (unsigned short *)(output + row * bytesPerRow);
+	fs_state_s state;
+	for (unsigned int x0 = 0; x0 < width; x0 += FS_WAVEFRONT_STEP) {
+	  unsigned int x1 = x0 + FS_WAVEFRONT_STEP < width ? x0 + FS_WAVEFRONT_STEP : width;
+	  if (row) {
+	    // entries up to x1 are ready when the row above has passed x1,
+	    // and the ones past the end when it has finished
+	    unsigned int needed = x1 < width ? x1 + 1 : width + 1;
+	    while (progress[row - 1].load(memory_order_acquire) < needed) this_thread::yield();
+	  }
+	  f(input, output_row, errors, x0, x1, width, state);
+	  progress[row].store(x1 < width ? x1 : width + 1, memory_order_release);
+	}
+      }
+    });
+
+  return size_t(width) * height * 2;
 }
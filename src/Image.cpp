@@ -26,6 +26,7 @@ Image::loadFromMemory(const unsigned char * buffer, size_t size) {
   assert(w && h && channels);    
 
   auto data = std::unique_ptr<ImageData>(new ImageData((unsigned char *)img_buffer, w, h, channels));
+  data->setPremultiplied(false); // stb_image does not premultiply alpha
   
   stbi_image_free(img_buffer);
   
@@ -43,6 +44,7 @@ Image::loadFromFile(const std::string & filename) {
   assert(w && h && channels);    
 
   auto data = std::unique_ptr<ImageData>(new ImageData((unsigned char *)img_buffer, w, h, channels));
+  data->setPremultiplied(false); // stb_image does not premultiply alpha
   
   stbi_image_free(img_buffer);
 
@@ -1,50 +1,177 @@
 #include <ImageData.h>
 
+#include "Convolution.h"
+#include "Mipmap.h"
+#include "PackPixel.h"
+#include "Parallel.h"
+
 #include <vector>
 #include <cassert>
+#include <cmath>
+#include <cstdlib>
+
+// stbir asks for its working memory on every call: give it a buffer
+// that is kept per thread when a context is passed
+static void * resize_workspace_alloc(size_t size, void * context);
+static void resize_workspace_free(void * ptr, void * context);
+#define STBIR_MALLOC(size, context) resize_workspace_alloc(size, context)
+#define STBIR_FREE(ptr, context) resize_workspace_free(ptr, context)
 
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
 #include "stb_image_resize.h"
 
+// Bytes of the source that the vertical kernel pass tries to keep in
+// cache (about the size of an L2 cache)
+#ifndef BLUR_STRIP_CACHE_SIZE
+#define BLUR_STRIP_CACHE_SIZE (192 * 1024)
+#endif
+
+// Smallest number of output pixels per band in a threaded scale
+#ifndef SCALE_MIN_BAND_SIZE
+#define SCALE_MIN_BAND_SIZE (64 * 1024)
+#endif
+
 using namespace std;
 using namespace canvas;
 
 ImageData ImageData::nullImage;
 
+void
+ImageData::detach() {
+  auto copy = std::make_shared<PixelBuffer>(data->getSize(), false);
+  memcpy(copy->get(), data->get(), data->getSize());
+  data = copy;
+}
+
+ImageDataView::ImageDataView(const ImageData & image)
+  : data(image.getData()), width(image.getWidth()), height(image.getHeight()), num_channels(image.getNumChannels()),
+    bytesPerRow(image.getBytesPerRow()), premultiplied(image.isPremultiplied()) { }
+
+static void * resize_workspace_alloc(size_t size, void * context) {
+  if (!context) return malloc(size);
+  PixelBuffer & workspace = *(PixelBuffer *)context;
+  if (workspace.getSize() < size) workspace = PixelBuffer(size, false);
+  return workspace.get();
+}
+
+static void resize_workspace_free(void * ptr, void * context) {
+  if (!context) free(ptr);
+}
+
+static PixelBuffer & get_resize_workspace() {
+  static thread_local PixelBuffer workspace;
+  return workspace;
+}
+
 std::unique_ptr<ImageData>
-ImageData::scale(unsigned short target_width, unsigned short target_height) const {
-  size_t target_size = calculateSize(target_width, target_height, num_channels);
+ImageData::scale(const ImageDataView & input, unsigned int target_width, unsigned int target_height, ResizeFilter filter, ResizeEdge edge, unsigned int num_threads) {
+  unsigned int num_channels = input.getNumChannels();
+  unique_ptr<ImageData> r(new ImageData(target_width, target_height, num_channels, false));
+  r->setPremultiplied(input.isPremultiplied());
 
-  std::unique_ptr<unsigned char[]> output_data(new unsigned char[target_size]);
+  // straight alpha lets stbir weight the color channels by alpha
+  int alpha_channel = num_channels == 4 && !input.isPremultiplied() ? 3 : -1;
+  unsigned char * output = r->getData();
+  size_t output_stride = r->getBytesPerRow();
 
-  stbir_resize_uint8(data.get(), getWidth(), getHeight(), 0, output_data.get(), target_width, target_height, 0, num_channels);
+  unsigned int num_bands = get_num_threads(num_threads);
+  size_t max_bands = size_t(target_width) * target_height / SCALE_MIN_BAND_SIZE;
+  if (num_bands > max_bands) num_bands = (unsigned int)max_bands;
+  if (num_bands > target_height) num_bands = target_height;
+  // the first and last rows wrap to the other edge of the whole image
+  if (edge == RESIZE_EDGE_WRAP) num_bands = 1;
 
-  return unique_ptr<ImageData>(new ImageData(output_data.get(), target_width, target_height, num_channels));
+  if (num_bands <= 1) {
+    stbir_resize(input.getData(), input.getWidth(), input.getHeight(), (int)input.getBytesPerRow(), output, target_width, target_height, (int)output_stride, STBIR_TYPE_UINT8, num_channels, alpha_channel, 0, stbir_edge(edge), stbir_edge(edge), stbir_filter(filter), stbir_filter(filter), STBIR_COLORSPACE_LINEAR, &get_resize_workspace());
+    return r;
+  }
+
+  // Each band of output rows is resized from the input rows under its
+  // filter, with the transform moved so that the band lands where it
+  // would in a single call. The margin covers the support of every
+  // filter with some room for rounding. stbir computes the weights in
+  // single precision from the moved transform, so they can round
+  // differently than in a single call, which changes some pixels by
+  // one. Wider margins do not help.
+  float xscale = float(target_width) / input.getWidth();
+  float yscale = float(target_height) / input.getHeight();
+  int margin = int(ceil(yscale < 1.0f ? 3.0f / yscale : 3.0f)) + 1;
+  parallel_for(num_bands, num_threads, [&](unsigned int begin, unsigned int end) {
+      for (unsigned int band = begin; band < end; band++) {
+	unsigned int y0 = (unsigned long long)target_height * band / num_bands;
+	unsigned int y1 = (unsigned long long)target_height * (band + 1) / num_bands;
+	int first_row = int(floor(y0 / yscale)) - margin;
+	int last_row = int(ceil(y1 / yscale)) + margin;
+	if (first_row < 0) first_row = 0;
+	if (last_row > int(input.getHeight())) last_row = input.getHeight();
+	stbir_resize_subpixel(input.getRow(first_row), input.getWidth(), last_row - first_row, (int)input.getBytesPerRow(), output + y0 * output_stride, target_width, y1 - y0, (int)output_stride, STBIR_TYPE_UINT8, num_channels, alpha_channel, 0, stbir_edge(edge), stbir_edge(edge), stbir_filter(filter), stbir_filter(filter), STBIR_COLORSPACE_LINEAR, &get_resize_workspace(), xscale, yscale, 0.0f, y0 - first_row * yscale);
+      }
+    });
+
+  return r;
 }
 
 std::unique_ptr<ImageData>
-ImageData::colorize(const Color & color) const {
-  assert(num_channels == 1);
+ImageData::colorize(const ImageDataView & input, const Color & color, bool premultiplied_output) {
+  assert(input.getNumChannels() == 1);
+  unsigned int width = input.getWidth(), height = input.getHeight();
 
-  int red = int(255 * color.red * color.alpha);
-  int green = int(255 * color.green * color.alpha);
-  int blue = int(255 * color.blue * color.alpha);
+  float f = premultiplied_output ? color.alpha : 1.0f;
+  int red = int(255 * color.red * f);
+  int green = int(255 * color.green * f);
+  int blue = int(255 * color.blue * f);
   int alpha = int(255 * color.alpha);
 
-  unique_ptr<ImageData> r(new ImageData(width, height, 4));
+  unique_ptr<ImageData> r(new ImageData(width, height, 4, false));
+  r->setPremultiplied(premultiplied_output);
 
   unsigned char * target_buffer = r->getData();
-  for (unsigned int i = 0; i < width * height; i++) {
-    unsigned char v = data[i];
-    target_buffer[4 * i + 0] = (unsigned char)(red * v / 255);
-    target_buffer[4 * i + 1] = (unsigned char)(green * v / 255);
-    target_buffer[4 * i + 2] = (unsigned char)(blue * v / 255);
-    target_buffer[4 * i + 3] = (unsigned char)(alpha * v / 255);
+  for (unsigned int row = 0; row < height; row++) {
+    const unsigned char * data = input.getRow(row);
+    if (premultiplied_output) {
+      for (unsigned int i = 0; i < width; i++, target_buffer += 4) {
+	unsigned char v = data[i];
+	target_buffer[0] = (unsigned char)(red * v / 255);
+	target_buffer[1] = (unsigned char)(green * v / 255);
+	target_buffer[2] = (unsigned char)(blue * v / 255);
+	target_buffer[3] = (unsigned char)(alpha * v / 255);
+      }
+    } else {
+      for (unsigned int i = 0; i < width; i++, target_buffer += 4) {
+	unsigned char v = data[i];
+	target_buffer[0] = (unsigned char)red;
+	target_buffer[1] = (unsigned char)green;
+	target_buffer[2] = (unsigned char)blue;
+	target_buffer[3] = (unsigned char)(alpha * v / 255);
+      }
+    }
   }
 
   return r;
 }
 
+std::unique_ptr<ImageData>
+ImageData::halve(const ImageDataView & input, bool srgb, unsigned int num_threads) {
+  unsigned int width = input.getWidth(), height = input.getHeight(), num_channels = input.getNumChannels();
+  unsigned int target_width = (width + 1) / 2, target_height = (height + 1) / 2;
+  
+  unique_ptr<ImageData> r(new ImageData(target_width, target_height, num_channels, false));
+  r->setPremultiplied(input.isPremultiplied());
+
+  int alpha_channel = num_channels == 4 ? 3 : (num_channels == 2 ? 1 : -1);
+  unsigned char * output = r->getData();
+  size_t output_stride = r->getBytesPerRow();
+  parallel_for(target_height, num_threads, [&](unsigned int begin, unsigned int end) {
+      for (unsigned int row = begin; row < end; row++) {
+	const unsigned char * row0 = input.getRow(2 * row);
+	const unsigned char * row1 = 2 * row + 1 < height ? input.getRow(2 * row + 1) : row0;
+	halve_span(row0, row1, output + row * output_stride, width, num_channels, srgb, alpha_channel);
+      }
+    });
+
+  return r;
+}
+
 static vector<int> make_kernel(float radius) {
   int r = (int)ceil(radius);
   int rows = 2 * r + 1;
@@ -67,117 +194,385 @@ static vector<int> make_kernel(float radius) {
   return kernel;
 }
 
-std::unique_ptr<ImageData>
-ImageData::blur(float hradius, float vradius) const {
-  unique_ptr<ImageData> r(new ImageData(width, height, num_channels));
-
-  if (num_channels == 4) {
-    unsigned char * tmp = new unsigned char[width * height * 4];
-    if (hradius > 0.0f) {
-      vector<int> hkernel = make_kernel(hradius);
-      unsigned short hsize = hkernel.size();
-
-      int htotal = 0;
-      for (auto & a : hkernel) htotal += a;
-
-      memset(tmp, 0, width * height * 4);
-      for (unsigned int row = 0; row < height; row++) {
-        for (unsigned int col = 0; col + hsize <= width; col++) {
-          int c0 = 0, c1 = 0, c2 = 0, c3 = 0;
-          for (unsigned int i = 0; i < hsize; i++) {
-            const unsigned char * ptr = getData() + (row * width + col + i) * 4;
-            c0 += *ptr++ * hkernel[i];
-            c1 += *ptr++ * hkernel[i];
-            c2 += *ptr++ * hkernel[i];
-            c3 += *ptr++ * hkernel[i];
-          }
-          unsigned char * ptr = tmp + (row * width + col + hsize / 2) * 4;
-          *ptr++ = (unsigned char)(c0 / htotal);
-          *ptr++ = (unsigned char)(c1 / htotal);
-          *ptr++ = (unsigned char)(c2 / htotal);
-          *ptr++ = (unsigned char)(c3 / htotal);
-        }
-      }
-    } else {
-      memcpy(tmp, getData(), width * height * 4);
+// Converts the kernel to fixed-point weights for convolve_span. The
+// center tap absorbs the rounding error so that flat areas stay flat.
+static vector<short> make_fixed_kernel(float radius) {
+  vector<int> kernel = make_kernel(radius);
+  int total = 0;
+  for (auto & a : kernel) total += a;
+
+  vector<short> fixed_kernel;
+  fixed_kernel.reserve(kernel.size());
+  int fixed_total = 0;
+  for (auto & a : kernel) {
+    short w = (short)((((long long)a << CONVOLUTION_SHIFT) + total / 2) / total);
+    fixed_kernel.push_back(w);
+    fixed_total += w;
+  }
+  fixed_kernel[fixed_kernel.size() / 2] += (1 << CONVOLUTION_SHIFT) - fixed_total;
+  return fixed_kernel;
+}
+
+// Calculates the radii of n successive box filters that together
+// approximate a gaussian with the given sigma
+static vector<int> make_boxes(float sigma, int n) {
+  float w_ideal = sqrt(12.0f * sigma * sigma / n + 1.0f);
+  int wl = int(floor(w_ideal));
+  if (wl % 2 == 0) wl--;
+  int wu = wl + 2;
+  float m_ideal = (12.0f * sigma * sigma - n * wl * wl - 4 * n * wl - 3 * n) / (-4.0f * wl - 4.0f);
+  int m = int(round(m_ideal));
+  vector<int> radii;
+  for (int i = 0; i < n; i++) {
+    radii.push_back(((i < m ? wl : wu) - 1) / 2);
+  }
+  return radii;
+}
+
+static void copy_rows(const unsigned char * input, size_t input_stride, unsigned char * output, size_t output_stride, size_t n, unsigned int height) {
+  for (unsigned int row = 0; row < height; row++) {
+    memcpy(output + row * output_stride, input + row * input_stride, n);
+  }
+}
+
+static void clear_rows(unsigned char * output, size_t output_stride, size_t n, unsigned int height) {
+  for (unsigned int row = 0; row < height; row++) {
+    memset(output + row * output_stride, 0, n);
+  }
+}
+
+// Pixels outside the image are treated as transparent, like in the
+// kernel blur
+static void box_blur_h(const unsigned char * input, size_t input_stride, unsigned char * output, size_t output_stride, unsigned int width, unsigned int first_row, unsigned int last_row, unsigned int num_channels, unsigned int radius) {
+  unsigned int d = 2 * radius + 1;
+  unsigned int sums[4];
+  for (unsigned int row = first_row; row < last_row; row++) {
+    const unsigned char * in = input + row * input_stride;
+    unsigned char * out = output + row * output_stride;
+    for (unsigned int c = 0; c < num_channels; c++) {
+      sums[c] = 0;
+      for (unsigned int i = 0; i <= radius && i < width; i++) sums[c] += in[i * num_channels + c];
     }
-    if (vradius > 0) {
-      vector<int> vkernel = make_kernel(vradius);
-      unsigned short vsize = vkernel.size();
-
-      int vtotal = 0;
-      for (auto & a : vkernel) vtotal += a;
-
-      memset(r->getData(), 0, width * height * 4);
-      for (unsigned int col = 0; col < width; col++) {
-        for (unsigned int row = 0; row + vsize <= height; row++) {
-          int c0 = 0, c1 = 0, c2 = 0, c3 = 0;
-          for (unsigned int i = 0; i < vsize; i++) {
-            const unsigned char * ptr = tmp + ((row + i) * width + col) * 4;
-            c0 += *ptr++ * vkernel[i];
-            c1 += *ptr++ * vkernel[i];
-            c2 += *ptr++ * vkernel[i];
-            c3 += *ptr++ * vkernel[i];
-          }
-          unsigned char * ptr = r->getData() + ((row + vsize / 2) * width + col) * 4;
-          *ptr++ = (unsigned char)(c0 / vtotal);
-          *ptr++ = (unsigned char)(c1 / vtotal);
-          *ptr++ = (unsigned char)(c2 / vtotal);
-          *ptr++ = (unsigned char)(c3 / vtotal);
-        }
+    for (unsigned int col = 0; col < width; col++) {
+      for (unsigned int c = 0; c < num_channels; c++) {
+	*out++ = (unsigned char)((sums[c] + d / 2) / d);
+	if (col + radius + 1 < width) sums[c] += in[(col + radius + 1) * num_channels + c];
+	if (col >= radius) sums[c] -= in[(col - radius) * num_channels + c];
       }
-    } else {
-      memcpy(r->getData(), tmp, width * height * 4);
     }
-    delete[] tmp;
-  } else if (num_channels == 1) {
-    unsigned char * tmp = new unsigned char[width * height];
-    if (hradius > 0.0f) {
-      vector<int> hkernel = make_kernel(hradius);
-      unsigned short hsize = hkernel.size();
-
-      int htotal = 0;
-      for (auto & a : hkernel) htotal += a;
-
-      memset(tmp, 0, width * height);
-      for (unsigned int row = 0; row < height; row++) {
-        for (unsigned int col = 0; col + hsize <= width; col++) {
-          int c0 = 0;
-          for (unsigned int i = 0; i < hsize; i++) {
-            const unsigned char * ptr = getData() + (row * width + col + i);
-            c0 += *ptr * hkernel[i];
-          }
-          unsigned char * ptr = tmp + (row * width + col + hsize / 2);
-          *ptr = (unsigned char)(c0 / htotal);
-        }
+  }
+}
+
+// The vertical pass keeps a running sum for each byte in [begin, end)
+// of the row so that the image is walked row by row
+static void box_blur_v(const unsigned char * input, size_t input_stride, unsigned char * output, size_t output_stride, unsigned int height, size_t begin, size_t end, unsigned int radius) {
+  unsigned int d = 2 * radius + 1;
+  size_t n = end - begin;
+  vector<unsigned int> sums(n, 0);
+  input += begin;
+  output += begin;
+  for (unsigned int row = 0; row <= radius && row < height; row++) {
+    const unsigned char * in = input + row * input_stride;
+    for (size_t i = 0; i < n; i++) sums[i] += in[i];
+  }
+  for (unsigned int row = 0; row < height; row++) {
+    unsigned char * out = output + row * output_stride;
+    for (size_t i = 0; i < n; i++) out[i] = (unsigned char)((sums[i] + d / 2) / d);
+    if (row + radius + 1 < height) {
+      const unsigned char * in = input + (row + radius + 1) * input_stride;
+      for (size_t i = 0; i < n; i++) sums[i] += in[i];
+    }
+    if (row >= radius) {
+      const unsigned char * in = input + (row - radius) * input_stride;
+      for (size_t i = 0; i < n; i++) sums[i] -= in[i];
+    }
+  }
+}
+
+static void box_blur(const unsigned char * input, size_t input_stride, unsigned char * output, size_t output_stride, unsigned int width, unsigned int height, unsigned int num_channels, float hradius, float vradius, unsigned int num_threads) {
+  vector<int> hboxes, vboxes;
+  if (hradius > 0.0f) hboxes = make_boxes(hradius / 3, 3);
+  if (vradius > 0.0f) vboxes = make_boxes(vradius / 3, 3);
+
+  size_t bytesPerRow = size_t(width) * num_channels;
+  unsigned int passes = hboxes.size() + vboxes.size();
+  if (!passes) {
+    copy_rows(input, input_stride, output, output_stride, bytesPerRow, height);
+    return;
+  }
+
+  // ping-pong between the buffers so that the last pass writes to output
+  PixelBuffer tmp(height * bytesPerRow, false);
+  unsigned char * buffers[2] = { output, tmp.get() };
+  size_t strides[2] = { output_stride, bytesPerRow };
+  const unsigned char * current = input;
+  size_t current_stride = input_stride;
+  unsigned int pass = 0;
+  for (auto & r : hboxes) {
+    unsigned int i = (passes - 1 - pass++) & 1;
+    unsigned char * target = buffers[i];
+    size_t target_stride = strides[i];
+    parallel_for(height, num_threads, [=](unsigned int begin, unsigned int end) {
+	box_blur_h(current, current_stride, target, target_stride, width, begin, end, num_channels, r);
+      });
+    current = target;
+    current_stride = target_stride;
+  }
+  // the columns are split in cache line sized chunks between the threads
+  unsigned int chunks = (unsigned int)((bytesPerRow + 63) / 64);
+  for (auto & r : vboxes) {
+    unsigned int i = (passes - 1 - pass++) & 1;
+    unsigned char * target = buffers[i];
+    size_t target_stride = strides[i];
+    parallel_for(chunks, num_threads, [=](unsigned int begin, unsigned int end) {
+	box_blur_v(current, current_stride, target, target_stride, height, begin * size_t(64), end * size_t(64) < bytesPerRow ? end * size_t(64) : bytesPerRow, r);
+      });
+    current = target;
+    current_stride = target_stride;
+  }
+}
+
+static void kernel_blur(const unsigned char * input, size_t input_stride, unsigned char * output, size_t output_stride, unsigned int width, unsigned int height, unsigned int num_channels, float hradius, float vradius, unsigned int num_threads) {
+  size_t bytesPerRow = size_t(width) * num_channels;
+  if (hradius <= 0.0f && vradius <= 0.0f) {
+    copy_rows(input, input_stride, output, output_stride, bytesPerRow, height);
+    return;
+  }
+
+  // the horizontal pass writes to tmp, or directly to output if there is no vertical pass
+  PixelBuffer tmp;
+  const unsigned char * vinput = input;
+  size_t vinput_stride = input_stride;
+  if (hradius > 0.0f) {
+    vector<short> hkernel = make_fixed_kernel(hradius);
+    unsigned int hsize = hkernel.size();
+
+    unsigned char * houtput = output;
+    size_t houtput_stride = output_stride;
+    if (vradius > 0.0f) {
+      tmp = PixelBuffer(height * bytesPerRow, false);
+      houtput = tmp.get();
+      houtput_stride = bytesPerRow;
+    }
+    clear_rows(houtput, houtput_stride, bytesPerRow, height);
+    if (hsize <= width) {
+      size_t n = (width - hsize + 1) * num_channels;
+      parallel_for(height, num_threads, [&](unsigned int begin, unsigned int end) {
+	  for (unsigned int row = begin; row < end; row++) {
+	    convolve_span(input + row * input_stride, houtput + row * houtput_stride + (hsize / 2) * num_channels, n, num_channels, hkernel.data(), hsize);
+	  }
+	});
+    }
+    vinput = houtput;
+    vinput_stride = houtput_stride;
+  }
+  if (vradius > 0.0f) {
+    vector<short> vkernel = make_fixed_kernel(vradius);
+    unsigned int vsize = vkernel.size();
+
+    clear_rows(output, output_stride, bytesPerRow, height);
+    // Walk the image in column strips narrow enough for the vsize
+    // rows under the kernel to stay in cache between output rows.
+    // The strips are divided between the threads.
+    size_t strip = BLUR_STRIP_CACHE_SIZE / vsize;
+    strip = strip < 64 ? 64 : strip & ~size_t(31);
+    unsigned int num_strips = (unsigned int)((bytesPerRow + strip - 1) / strip);
+    if (num_strips < get_num_threads(num_threads)) {
+      // narrow image: use smaller strips so that every thread gets work
+      unsigned int n = get_num_threads(num_threads);
+      strip = ((bytesPerRow + n - 1) / n + 63) & ~size_t(63);
+      num_strips = (unsigned int)((bytesPerRow + strip - 1) / strip);
+    }
+    parallel_for(num_strips, num_threads, [&](unsigned int begin, unsigned int end) {
+	for (size_t offset = begin * strip; offset < end * strip && offset < bytesPerRow; offset += strip) {
+	  size_t n = bytesPerRow - offset < strip ? bytesPerRow - offset : strip;
+	  for (unsigned int row = 0; row + vsize <= height; row++) {
+	    convolve_span(vinput + row * vinput_stride + offset, output + (row + vsize / 2) * output_stride + offset, n, vinput_stride, vkernel.data(), vsize);
+	  }
+	}
+      });
+  }
+}
+
+// Averages hstep x vstep blocks (1 or 2 in each direction). Odd
+// edges are clamped.
+static void downsample(const unsigned char * input, size_t input_stride, unsigned int width, unsigned int height, unsigned char * output, size_t output_stride, unsigned int num_channels, unsigned int hstep, unsigned int vstep, unsigned int num_threads) {
+  unsigned int target_width = (width + hstep - 1) / hstep, target_height = (height + vstep - 1) / vstep;
+  parallel_for(target_height, num_threads, [=](unsigned int begin, unsigned int end) {
+      for (unsigned int row = begin; row < end; row++) {
+	const unsigned char * row0 = input + row * vstep * input_stride;
+	const unsigned char * row1 = row * vstep + vstep - 1 < height ? row0 + (vstep - 1) * input_stride : row0;
+	unsigned char * target = output + row * output_stride;
+	if (hstep == 2) {
+	  halve_span(row0, row1, target, width, num_channels);
+	  continue;
+	}
+	for (unsigned int col = 0; col < target_width; col++) {
+	  size_t offset0 = col * hstep * num_channels;
+	  size_t offset1 = col * hstep + hstep - 1 < width ? offset0 + (hstep - 1) * num_channels : offset0;
+	  for (unsigned int c = 0; c < num_channels; c++) {
+	    unsigned int v = row0[offset0 + c] + row0[offset1 + c] + row1[offset0 + c] + row1[offset1 + c];
+	    *target++ = (unsigned char)((v + 2) >> 2);
+	  }
+	}
       }
-    } else {
-      memcpy(tmp, getData(), width * height);
+    });
+}
+
+// Bilinear upsampling with pixel centers aligned and edges clamped.
+// The sampling positions are moved by (hoffset, voffset) source
+// pixels in 8-bit fixed point.
+static void upsample(const unsigned char * input, size_t input_stride, unsigned int width, unsigned int height, unsigned char * output, size_t output_stride, unsigned int target_width, unsigned int target_height, unsigned int num_channels, int hoffset, int voffset, unsigned int num_threads) {
+  // source offset and 8-bit weight of the second sample for each target byte
+  size_t n = target_width * num_channels;
+  vector<unsigned int> offsets(n);
+  vector<unsigned short> weights(n);
+  for (unsigned int col = 0; col < target_width; col++) {
+    int x = int((((long long)col * 2 + 1) * width * 256) / (2 * target_width)) - 128 + hoffset;
+    if (x < 0) x = 0;
+    if (x > int(width - 1) * 256) x = int(width - 1) * 256;
+    for (unsigned int c = 0; c < num_channels; c++) {
+      offsets[col * num_channels + c] = (x >> 8) * num_channels + c;
+      weights[col * num_channels + c] = x & 255;
     }
-    if (vradius > 0) {
-      vector<int> vkernel = make_kernel(vradius);
-      unsigned short vsize = vkernel.size();
-      int vtotal = 0;
-      for (auto & a : vkernel) vtotal += a;
-
-      memset(r->getData(), 0, width * height);
-      for (unsigned int col = 0; col < width; col++) {
-        for (unsigned int row = 0; row + vsize <= height; row++) {
-          int c0 = 0;
-          for (unsigned int i = 0; i < vsize; i++) {
-            const unsigned char * ptr = tmp + ((row + i) * width + col);
-            c0 += *ptr * vkernel[i];
-          }
-          unsigned char * ptr = r->getData() + ((row + vsize / 2) * width + col);
-          *ptr = (unsigned char)(c0 / vtotal);
-        }
+  }
+  parallel_for(target_height, num_threads, [&](unsigned int begin, unsigned int end) {
+      // source rows interpolated horizontally, kept while consecutive target rows share them
+      vector<unsigned short> rows[2] = { vector<unsigned short>(n), vector<unsigned short>(n) };
+      int cached[2] = { -1, -1 };
+      for (unsigned int row = begin; row < end; row++) {
+	int y = int((((long long)row * 2 + 1) * height * 256) / (2 * target_height)) - 128 + voffset;
+	if (y < 0) y = 0;
+	if (y > int(height - 1) * 256) y = int(height - 1) * 256;
+	unsigned int fy = y & 255;
+	int source_rows[2] = { y >> 8, fy ? (y >> 8) + 1 : y >> 8 };
+	if (cached[1] == source_rows[0]) {
+	  rows[0].swap(rows[1]);
+	  std::swap(cached[0], cached[1]);
+	}
+	for (unsigned int i = 0; i < 2; i++) {
+	  if (cached[i] == source_rows[i]) continue;
+	  const unsigned char * source = input + source_rows[i] * input_stride;
+	  unsigned short * h = rows[i].data();
+	  for (size_t j = 0; j < n; j++) {
+	    unsigned int o = offsets[j], fx = weights[j];
+	    unsigned int o1 = fx ? o + num_channels : o;
+	    h[j] = (unsigned short)(source[o] * (256 - fx) + source[o1] * fx);
+	  }
+	  cached[i] = source_rows[i];
+	}
+	const unsigned short * top = rows[0].data(), * bottom = rows[1].data();
+	unsigned char * target = output + row * output_stride;
+	for (size_t j = 0; j < n; j++) {
+	  target[j] = (unsigned char)((top[j] * (256 - fy) + bottom[j] * fy + 32768) >> 16);
+	}
       }
-    } else {
-      memcpy(r->getData(), tmp, width * height);
+    });
+}
+
+// Halves the resolution in each direction whose radius is above the
+// threshold, blurs the reduced copy with the kernel and scales it back
+static void pyramid_blur(const unsigned char * input, size_t input_stride, unsigned char * output, size_t output_stride, unsigned int width, unsigned int height, unsigned int num_channels, float hradius, float vradius, float threshold, unsigned int num_threads) {
+  if (threshold < 1.0f) threshold = 1.0f;
+
+  PixelBuffer level;
+  const unsigned char * current = input;
+  size_t current_stride = input_stride;
+  unsigned int current_width = width, current_height = height;
+  unsigned int hscale = 1, vscale = 1;
+  while (1) {
+    unsigned int hstep = hradius > threshold && current_width >= 2 ? 2 : 1;
+    unsigned int vstep = vradius > threshold && current_height >= 2 ? 2 : 1;
+    if (hstep == 1 && vstep == 1) break;
+    unsigned int next_width = (current_width + hstep - 1) / hstep, next_height = (current_height + vstep - 1) / vstep;
+    size_t next_stride = next_width * num_channels;
+    PixelBuffer next(next_stride * next_height, false);
+    downsample(current, current_stride, current_width, current_height, next.get(), next_stride, num_channels, hstep, vstep, num_threads);
+    level = std::move(next);
+    current = level.get();
+    current_stride = next_stride;
+    current_width = next_width;
+    current_height = next_height;
+    hradius /= hstep;
+    vradius /= vstep;
+    hscale *= hstep;
+    vscale *= vstep;
+  }
+
+  if (current == input) {
+    kernel_blur(input, input_stride, output, output_stride, width, height, num_channels, hradius, vradius, num_threads);
+  } else {
+    PixelBuffer blurred(current_stride * current_height, false);
+    kernel_blur(current, current_stride, blurred.get(), current_stride, current_width, current_height, num_channels, hradius, vradius, num_threads);
+    // the kernel is off center by one tap, which is scale pixels at
+    // the reduced level: move it back to where the full resolution kernel has it
+    int hoffset = hradius > 0.0f ? -int((hscale - 1) * 256 / hscale) : 0;
+    int voffset = vradius > 0.0f ? -int((vscale - 1) * 256 / vscale) : 0;
+    upsample(blurred.get(), current_stride, current_width, current_height, output, output_stride, width, height, num_channels, hoffset, voffset, num_threads);
+  }
+}
+
+static void blur_buffer(const unsigned char * input, size_t input_stride, unsigned char * output, size_t output_stride, unsigned int width, unsigned int height, unsigned int num_channels, float hradius, float vradius, BlurMode mode, unsigned int num_threads, float pyramid_threshold) {
+  if (mode == BOX_BLUR) {
+    box_blur(input, input_stride, output, output_stride, width, height, num_channels, hradius, vradius, num_threads);
+  } else if (mode == PYRAMID_BLUR) {
+    pyramid_blur(input, input_stride, output, output_stride, width, height, num_channels, hradius, vradius, pyramid_threshold, num_threads);
+  } else {
+    kernel_blur(input, input_stride, output, output_stride, width, height, num_channels, hradius, vradius, num_threads);
+  }
+}
+
+// Expands each row of one channel values into premultiplied native
+// endian ARGB32 in place. The rows are walked from right to left so
+// that no value is overwritten before it has been read.
+static void colorize_rows(unsigned char * buffer, size_t stride, unsigned int width, unsigned int height, const Color & color) {
+  unsigned int red = (unsigned int)(255 * color.red * color.alpha);
+  unsigned int green = (unsigned int)(255 * color.green * color.alpha);
+  unsigned int blue = (unsigned int)(255 * color.blue * color.alpha);
+  unsigned int alpha = (unsigned int)(255 * color.alpha);
+  
+  unsigned int lut[256];
+  for (unsigned int v = 0; v < 256; v++) {
+    lut[v] = ((alpha * v / 255) << 24) | ((red * v / 255) << 16) | ((green * v / 255) << 8) | (blue * v / 255);
+  }
+  for (unsigned int row = 0; row < height; row++) {
+    unsigned char * input = buffer + row * stride;
+    unsigned int * output = (unsigned int *)input;
+    for (unsigned int col = width; col > 0; col--) {
+      output[col - 1] = lut[input[col - 1]];
     }
-    delete[] tmp;
   }
+}
 
+std::unique_ptr<ImageData>
+ImageData::blur(const ImageDataView & input, float hradius, float vradius, BlurMode mode, unsigned int num_threads, float pyramid_threshold) {
+  unsigned int width = input.getWidth(), height = input.getHeight(), num_channels = input.getNumChannels();
+  unique_ptr<ImageData> r(new ImageData(width, height, num_channels, false));
+  r->setPremultiplied(input.isPremultiplied());
+  if (num_channels == 4 && !input.isPremultiplied()) {
+    // straight alpha has to be weighted during the blur, otherwise
+    // transparent pixels bleed their color into the edges
+    ImageData tmp(width, height, num_channels, false);
+    copy_rows(input.getData(), input.getBytesPerRow(), tmp.getData(), tmp.getBytesPerRow(), tmp.getBytesPerRow(), height);
+    premultiply_span((const unsigned int *)tmp.getData(), (unsigned int *)tmp.getData(), size_t(width) * height);
+    blur_buffer(tmp.getData(), tmp.getBytesPerRow(), r->getData(), r->getBytesPerRow(), width, height, num_channels, hradius, vradius, mode, num_threads, pyramid_threshold);
+    unpremultiply_span((const unsigned int *)r->getData(), (unsigned int *)r->getData(), size_t(width) * height);
+  } else {
+    blur_buffer(input.getData(), input.getBytesPerRow(), r->getData(), r->getBytesPerRow(), width, height, num_channels, hradius, vradius, mode, num_threads, pyramid_threshold);
+  }
   return r;
 }
 
+void
+ImageData::colorize(const Color & color, unsigned char * output, size_t bytesPerRow) const {
+  assert(num_channels == 1);
+  copy_rows(getData(), getBytesPerRow(), output, bytesPerRow, width, height);
+  colorize_rows(output, bytesPerRow, width, height, color);
+}
+
+void
+ImageData::blurColorize(const unsigned char * input, size_t input_bytesPerRow, unsigned int width, unsigned int height, float hradius, float vradius, const Color & color, unsigned char * output, size_t output_bytesPerRow, BlurMode mode, unsigned int num_threads, float pyramid_threshold) {
+  // the blurred mask is written to the beginning of each output row and then expanded
+  blur_buffer(input, input_bytesPerRow, output, output_bytesPerRow, width, height, 1, hradius, vradius, mode, num_threads, pyramid_threshold);
+  colorize_rows(output, output_bytesPerRow, width, height, color);
+}
@@ -0,0 +1,119 @@
+#include "Mipmap.h"
+
+#include "CpuFeatures.h"
+
+#include <cmath>
+
+using namespace canvas;
+
+// Averages the pairs from first_pair on with plain integer math
+static void halve_span_scalar(const unsigned char * row0, const unsigned char * row1, unsigned char * output, unsigned int width, unsigned int num_channels, unsigned int first_pair) {
+  unsigned int target_width = (width + 1) / 2;
+  for (unsigned int x = first_pair; x < target_width; x++) {
+    unsigned int o0 = 2 * x * num_channels;
+    unsigned int o1 = 2 * x + 1 < width ? o0 + num_channels : o0;
+    for (unsigned int c = 0; c < num_channels; c++) {
+      unsigned int v = row0[o0 + c] + row0[o1 + c] + row1[o0 + c] + row1[o1 + c];
+      output[x * num_channels + c] = (unsigned char)((v + 2) >> 2);
+    }
+  }
+}
+
+// sRGB to linear with 12 bits of precision and back, for averaging in
+// linear light
+class SRGBTables {
+public:
+  SRGBTables() {
+    for (unsigned int i = 0; i < 256; i++) {
+      double v = i / 255.0;
+      v = v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+      to_linear[i] = (unsigned short)(v * 4095.0 + 0.5);
+    }
+    for (unsigned int i = 0; i < 4096; i++) {
+      double v = i / 4095.0;
+      v = v <= 0.0031308 ? v * 12.92 : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+      from_linear[i] = (unsigned char)(v * 255.0 + 0.5);
+    }
+  }
+
+  unsigned short to_linear[256];
+  unsigned char from_linear[4096];
+};
+
+static void halve_span_srgb(const unsigned char * row0, const unsigned char * row1, unsigned char * output, unsigned int width, unsigned int num_channels, int alpha_channel) {
+  static const SRGBTables tables;
+  unsigned int target_width = (width + 1) / 2;
+  for (unsigned int x = 0; x < target_width; x++) {
+    unsigned int o0 = 2 * x * num_channels;
+    unsigned int o1 = 2 * x + 1 < width ? o0 + num_channels : o0;
+    for (unsigned int c = 0; c < num_channels; c++) {
+      if (int(c) == alpha_channel) {
+	unsigned int v = row0[o0 + c] + row0[o1 + c] + row1[o0 + c] + row1[o1 + c];
+	output[x * num_channels + c] = (unsigned char)((v + 2) >> 2);
+      } else {
+	unsigned int v = tables.to_linear[row0[o0 + c]] + tables.to_linear[row0[o1 + c]] + tables.to_linear[row1[o0 + c]] + tables.to_linear[row1[o1 + c]];
+	output[x * num_channels + c] = tables.from_linear[(v + 2) >> 2];
+      }
+    }
+  }
+}
+
+#ifdef CANVAS_HAS_X86
+// Each step reads 16 bytes from both rows, sums them vertically as
+// 16-bit values and then adds up the horizontal pixel pairs, which
+// lie next to each other at a distance that depends on the pixel size.
+CANVAS_TARGET("sse2")
+static void halve_span_sse2(const unsigned char * row0, const unsigned char * row1, unsigned char * output, unsigned int width, unsigned int num_channels) {
+  if (num_channels != 1 && num_channels != 2 && num_channels != 4) {
+    halve_span_scalar(row0, row1, output, width, num_channels, 0);
+    return;
+  }
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i two = _mm_set1_epi16(2);
+  const __m128i ones = _mm_set1_epi16(1);
+  size_t n = size_t(width / 2) * 2 * num_channels; // bytes in complete pairs
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(row0 + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(row1 + i));
+    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+    __m128i sum;
+    if (num_channels == 1) {
+      sum = _mm_packs_epi32(_mm_madd_epi16(lo, ones), _mm_madd_epi16(hi, ones));
+    } else if (num_channels == 2) {
+      __m128 flo = _mm_castsi128_ps(lo), fhi = _mm_castsi128_ps(hi);
+      sum = _mm_add_epi16(_mm_castps_si128(_mm_shuffle_ps(flo, fhi, _MM_SHUFFLE(2, 0, 2, 0))),
+			  _mm_castps_si128(_mm_shuffle_ps(flo, fhi, _MM_SHUFFLE(3, 1, 3, 1))));
+    } else {
+      sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+    }
+    sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+    _mm_storel_epi64((__m128i *)(output + i / 2), _mm_packus_epi16(sum, zero));
+  }
+  halve_span_scalar(row0, row1, output, width, num_channels, (unsigned int)(i / (2 * num_channels)));
+}
+#endif
+
+typedef void (*halve_span_func)(const unsigned char * row0, const unsigned char * row1, unsigned char * output, unsigned int width, unsigned int num_channels);
+
+static void halve_span_default(const unsigned char * row0, const unsigned char * row1, unsigned char * output, unsigned int width, unsigned int num_channels) {
+  halve_span_scalar(row0, row1, output, width, num_channels, 0);
+}
+
+static halve_span_func select_halve_span() {
+#ifdef CANVAS_HAS_X86
+  if (CpuFeatures::hasSSE2()) return halve_span_sse2;
+#endif
+  return halve_span_default;
+}
+
+void
+canvas::halve_span(const unsigned char * row0, const unsigned char * row1, unsigned char * output, unsigned int width, unsigned int num_channels, bool srgb, int alpha_channel) {
+  if (srgb) {
+    halve_span_srgb(row0, row1, output, width, num_channels, alpha_channel);
+  } else {
+    static halve_span_func f = select_halve_span();
+    f(row0, row1, output, width, num_channels);
+  }
+}
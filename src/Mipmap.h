@@ -0,0 +1,15 @@
+#ifndef _MIPMAP_H_
+#define _MIPMAP_H_
+
+#include <cstddef>
+
+namespace canvas {
+  // Averages the 2x2 blocks of two source rows of width pixels into
+  // (width + 1) / 2 output pixels, rounding to nearest. An odd last
+  // column is averaged with itself. With srgb set, all channels except
+  // alpha_channel (-1 for none) are averaged in linear light. The best
+  // available instruction set is selected at runtime.
+  void halve_span(const unsigned char * row0, const unsigned char * row1, unsigned char * output, unsigned int width, unsigned int num_channels, bool srgb = false, int alpha_channel = -1);
+};
+
+#endif
@@ -0,0 +1,237 @@
+#include <OrderedDither.h>
+
+#include <ImageData.h>
+#include <PixelBuffer.h>
+
+#include "CpuFeatures.h"
+#include "PackPixel.h"
+#include "Parallel.h"
+
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+using namespace std;
+using namespace canvas;
+
+#define BAYER_SIZE 8
+#define BLUE_NOISE_SIZE 64
+// Smallest image in pixels that is dithered with several threads
+#define ORDERED_DITHER_MIN_PARALLEL_SIZE (64 * 1024)
+
+// Tileable blue noise thresholds made with the void-and-cluster method.
+// The energy sums are integers, so the mask is the same everywhere.
+class BlueNoiseMask {
+public:
+  BlueNoiseMask() {
+    const int N = BLUE_NOISE_SIZE, n = N * N, R = 6;
+    const double sigma = 1.5;
+    vector<int> kernel((2 * R + 1) * (2 * R + 1));
+    for (int dy = -R; dy <= R; dy++) {
+      for (int dx = -R; dx <= R; dx++) {
+	kernel[(dy + R) * (2 * R + 1) + dx + R] = int(65536.0 * exp(-(dx * dx + dy * dy) / (2 * sigma * sigma)) + 0.5);
+      }
+    }
+    vector<int> energy(n, 0), ranks(n, 0);
+    vector<char> bits(n, 0);
+    auto update = [&](int i, int sign) {
+      int x0 = i % N, y0 = i / N;
+      for (int dy = -R; dy <= R; dy++) {
+	int y = (y0 + dy + N) % N;
+	for (int dx = -R; dx <= R; dx++) {
+	  energy[y * N + (x0 + dx + N) % N] += sign * kernel[(dy + R) * (2 * R + 1) + dx + R];
+	}
+      }
+    };
+    auto tightest_cluster = [&]() {
+      int best = -1;
+      for (int i = 0; i < n; i++) if (bits[i] && (best < 0 || energy[i] > energy[best])) best = i;
+      return best;
+    };
+    auto largest_void = [&]() {
+      int best = -1;
+      for (int i = 0; i < n; i++) if (!bits[i] && (best < 0 || energy[i] < energy[best])) best = i;
+      return best;
+    };
+
+    // random initial pattern, relaxed by moving points from the
+    // tightest cluster to the largest void until that changes nothing
+    int ones = n / 10;
+    unsigned int seed = 1;
+    for (int k = 0; k < ones; ) {
+      seed = seed * 1103515245 + 12345;
+      int i = (seed >> 8) % n;
+      if (!bits[i]) {
+	bits[i] = 1;
+	update(i, 1);
+	k++;
+      }
+    }
+    while (1) {
+      int c = tightest_cluster();
+      bits[c] = 0;
+      update(c, -1);
+      int v = largest_void();
+      bits[v] = 1;
+      update(v, 1);
+      if (v == c) break;
+    }
+
+    // rank the initial points by removing the tightest clusters, then
+    // the rest by filling the largest voids
+    vector<char> prototype_bits = bits;
+    vector<int> prototype_energy = energy;
+    for (int rank = ones - 1; rank >= 0; rank--) {
+      int c = tightest_cluster();
+      bits[c] = 0;
+      update(c, -1);
+      ranks[c] = rank;
+    }
+    bits = prototype_bits;
+    energy = prototype_energy;
+    for (int rank = ones; rank < n; rank++) {
+      int v = largest_void();
+      bits[v] = 1;
+      update(v, 1);
+      ranks[v] = rank;
+    }
+
+    for (int i = 0; i < n; i++) thresholds[i] = (unsigned char)(ranks[i] * 256 / n);
+  }
+
+  unsigned char thresholds[BLUE_NOISE_SIZE * BLUE_NOISE_SIZE];
+};
+
+// The 8x8 Bayer matrix, where the lowest coordinate bits select the
+// most significant base 4 digit of the threshold
+class BayerMatrix {
+public:
+  BayerMatrix() {
+    static const unsigned int digits[4] = { 0, 2, 3, 1 };
+    for (unsigned int y = 0; y < BAYER_SIZE; y++) {
+      for (unsigned int x = 0; x < BAYER_SIZE; x++) {
+	unsigned int v = 0;
+	for (unsigned int bit = 0; bit < 3; bit++) {
+	  v |= digits[((y >> bit) & 1) * 2 + ((x >> bit) & 1)] << (2 * (2 - bit));
+	}
+	thresholds[y * BAYER_SIZE + x] = (unsigned char)(v * 4);
+      }
+    }
+  }
+
+  unsigned char thresholds[BAYER_SIZE * BAYER_SIZE];
+};
+
+// Bits per channel in RGBA order
+static void get_channel_bits(InternalFormat format, unsigned int * bits) {
+  switch (format) {
+  case RGBA4: bits[0] = bits[1] = bits[2] = bits[3] = 4; break;
+  case RGBA5551: bits[0] = bits[1] = bits[2] = 5; bits[3] = 1; break;
+  case RGB555: bits[0] = bits[1] = bits[2] = 5; bits[3] = 8; break;
+  default: bits[0] = bits[2] = 5; bits[1] = 6; bits[3] = 8; break;
+  }
+}
+
+// Adds the offsets of a mask row, one RGBA32 value per pixel, with
+// saturation and packs the result
+template<InternalFormat F>
+static void dither_row(const unsigned int * input, unsigned short * output, const unsigned int * offsets, unsigned int size, unsigned int width) {
+  for (unsigned int x = 0; x < width; x++) {
+    unsigned int v = input[x], o = offsets[x % size], r = 0;
+    for (unsigned int c = 0; c < 32; c += 8) {
+      unsigned int value = ((v >> c) & 0xff) + ((o >> c) & 0xff);
+      r |= (value > 255 ? 255 : value) << c;
+    }
+    output[x] = pack_rgba32<F>(r);
+  }
+}
+
+#ifdef CANVAS_HAS_X86
+template<InternalFormat F>
+CANVAS_TARGET("sse2")
+static void dither_row_sse2(const unsigned int * input, unsigned short * output, const unsigned int * offsets, unsigned int size, unsigned int width) {
+  // the mask size is a multiple of eight, so eight pixels never wrap
+  unsigned int x = 0;
+  for (; x + 8 <= width; x += 8) {
+    const unsigned int * o = offsets + x % size;
+    __m128i v0 = _mm_adds_epu8(_mm_loadu_si128((const __m128i *)(input + x)), _mm_loadu_si128((const __m128i *)o));
+    __m128i v1 = _mm_adds_epu8(_mm_loadu_si128((const __m128i *)(input + x + 4)), _mm_loadu_si128((const __m128i *)(o + 4)));
+    _mm_storeu_si128((__m128i *)(output + x), pack_rgba32_sse2<F>(v0, v1));
+  }
+  dither_row<F>(input + x, output + x, offsets + x % size, size, width - x);
+}
+#endif
+
+typedef void (*dither_row_func)(const unsigned int * input, unsigned short * output, const unsigned int * offsets, unsigned int size, unsigned int width);
+
+template<InternalFormat F>
+static dither_row_func select_dither_row() {
+#ifdef CANVAS_HAS_X86
+  if (CpuFeatures::hasSSE2()) return dither_row_sse2<F>;
+#endif
+  return dither_row<F>;
+}
+
+static dither_row_func get_dither_row(InternalFormat format) {
+  static dither_row_func rgba4 = select_dither_row<RGBA4>();
+  static dither_row_func rgba5551 = select_dither_row<RGBA5551>();
+  static dither_row_func rgb555 = select_dither_row<RGB555>();
+  static dither_row_func rgb565 = select_dither_row<RGB565>();
+  switch (format) {
+  case RGBA4: return rgba4;
+  case RGBA5551: return rgba5551;
+  case RGB555: return rgb555;
+  default: return rgb565;
+  }
+}
+
+size_t
+OrderedDither::apply(const ImageDataView & input_image, unsigned char * output, size_t bytesPerRow, unsigned int num_threads, unsigned int first_row) const {
+  assert(mode == DITHER_BAYER || mode == DITHER_BLUE_NOISE);
+  unsigned int width = input_image.getWidth();
+  unsigned int height = input_image.getHeight();
+  assert(input_image.getNumChannels() == 4 || input_image.getNumChannels() == 3 || input_image.getNumChannels() == 1);
+
+  const unsigned char * thresholds;
+  unsigned int size;
+  if (mode == DITHER_BAYER) {
+    static const BayerMatrix bayer;
+    thresholds = bayer.thresholds;
+    size = BAYER_SIZE;
+  } else {
+    static const BlueNoiseMask blue_noise;
+    thresholds = blue_noise.thresholds;
+    size = BLUE_NOISE_SIZE;
+  }
+
+  // Offsets in [0, 2^(8 - bits)) for each channel, so that truncation
+  // rounds up with a probability that matches the dropped bits. The
+  // channels share the threshold to keep the noise colorless.
+  unsigned int bits[4];
+  get_channel_bits(target_format, bits);
+  PixelBuffer offsets_buffer(size_t(size) * size * 4, false);
+  unsigned int * offsets = (unsigned int *)offsets_buffer.get();
+  for (unsigned int i = 0; i < size * size; i++) {
+    unsigned int t = thresholds[i];
+    offsets[i] = (t >> bits[0]) | ((t >> bits[1]) << 8) | ((t >> bits[2]) << 16) | ((t >> bits[3]) << 24);
+  }
+
+  if (size_t(width) * height < ORDERED_DITHER_MIN_PARALLEL_SIZE) num_threads = 1;
+  num_threads = get_num_threads(num_threads);
+  if (num_threads > height) num_threads = height;
+  size_t converted_size = needs_rgba32_conversion(input_image, unpremultiply) ? size_t(width) * 4 : 0;
+  PixelBuffer converted_buffer(num_threads * converted_size, false);
+
+  dither_row_func f = get_dither_row(target_format);
+  parallel_for(num_threads, num_threads, [&](unsigned int begin, unsigned int end) {
+      assert(end == begin + 1);
+      unsigned int * converted = (unsigned int *)(converted_buffer.get() + begin * converted_size);
+      unsigned int row0 = (unsigned long long)height * begin / num_threads;
+      unsigned int row1 = (unsigned long long)height * end / num_threads;
+      for (unsigned int row = row0; row < row1; row++) {
+	f(get_rgba32_row(input_image, row, converted, unpremultiply), (unsigned short *)(output + row * bytesPerRow), offsets + ((first_row + row) % size) * size, size, width);
+      }
+    });
+
+  return size_t(width) * height * 2;
+}
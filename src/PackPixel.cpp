@@ -0,0 +1,349 @@
+#include "PackPixel.h"
+
+#include <cassert>
+
+using namespace std;
+using namespace canvas;
+
+// Scalar versions, which also finish the spans of the SIMD versions
+
+static void expand_span_scalar(const unsigned char * input, unsigned int num_channels, unsigned int * output, size_t n) {
+  switch (num_channels) {
+  case 1:
+    for (size_t i = 0; i < n; i++) {
+      unsigned int v = input[i];
+      output[i] = PACK_RGBA32(v, v, v, 0xff);
+    }
+    break;
+  case 2:
+    for (size_t i = 0; i < n; i++, input += 2) {
+      output[i] = PACK_RGBA32(input[0], input[0], input[0], input[1]);
+    }
+    break;
+  case 3:
+    for (size_t i = 0; i < n; i++, input += 3) {
+      output[i] = PACK_RGBA32(input[0], input[1], input[2], 0xff);
+    }
+    break;
+  default:
+    assert(0);
+  }
+}
+
+template<bool swap>
+static void expand_rgb_span_scalar(const unsigned char * input, unsigned int * output, size_t n) {
+  for (size_t i = 0; i < n; i++, input += 3) {
+    output[i] = swap ? PACK_RGBA32(input[2], input[1], input[0], 0xff) : PACK_RGBA32(input[0], input[1], input[2], 0xff);
+  }
+}
+
+static void swap_red_blue_span_scalar(const unsigned int * input, unsigned int * output, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    unsigned int v = input[i];
+    output[i] = (v & 0xff00ff00) | ((v >> 16) & 0xff) | ((v & 0xff) << 16);
+  }
+}
+
+static void premultiply_span_scalar(const unsigned int * input, unsigned int * output, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    unsigned int v = input[i], a = RGBA_TO_ALPHA(v);
+    output[i] = PACK_RGBA32((RGBA_TO_RED(v) * a + 127) / 255, (RGBA_TO_GREEN(v) * a + 127) / 255, (RGBA_TO_BLUE(v) * a + 127) / 255, a);
+  }
+}
+
+static void unpremultiply_span_scalar(const unsigned int * input, unsigned int * output, size_t n) {
+  for (size_t i = 0; i < n; i++) output[i] = unpremultiply_rgba32(input[i]);
+}
+
+static void pack_la44_span_scalar(const unsigned int * input, unsigned char * output, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    unsigned int v = input[i];
+    unsigned int lum = (RGBA_TO_RED(v) + RGBA_TO_GREEN(v) + RGBA_TO_BLUE(v)) / 3;
+    output[i] = (unsigned char)((RGBA_TO_ALPHA(v) & 0xf0) | (lum >> 4));
+  }
+}
+
+#ifdef CANVAS_HAS_X86
+CANVAS_TARGET("sse2")
+static void expand_span_sse2(const unsigned char * input, unsigned int num_channels, unsigned int * output, size_t n) {
+  const __m128i alpha = _mm_set1_epi32(0xff000000);
+  size_t i = 0;
+  if (num_channels == 1) {
+    for (; i + 16 <= n; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(input + i));
+      __m128i lo = _mm_unpacklo_epi8(v, v), hi = _mm_unpackhi_epi8(v, v);
+      _mm_storeu_si128((__m128i *)(output + i), _mm_or_si128(_mm_unpacklo_epi16(lo, lo), alpha));
+      _mm_storeu_si128((__m128i *)(output + i + 4), _mm_or_si128(_mm_unpackhi_epi16(lo, lo), alpha));
+      _mm_storeu_si128((__m128i *)(output + i + 8), _mm_or_si128(_mm_unpacklo_epi16(hi, hi), alpha));
+      _mm_storeu_si128((__m128i *)(output + i + 12), _mm_or_si128(_mm_unpackhi_epi16(hi, hi), alpha));
+    }
+  } else if (num_channels == 2) {
+    // luminance twice in the low and luminance and alpha in the high half
+    const __m128i mask = _mm_set1_epi16(0xff);
+    for (; i + 8 <= n; i += 8) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(input + 2 * i));
+      __m128i l = _mm_and_si128(v, mask);
+      __m128i ll = _mm_or_si128(l, _mm_slli_epi16(l, 8));
+      __m128i la = _mm_or_si128(l, _mm_slli_epi16(_mm_srli_epi16(v, 8), 8));
+      _mm_storeu_si128((__m128i *)(output + i), _mm_unpacklo_epi16(ll, la));
+      _mm_storeu_si128((__m128i *)(output + i + 4), _mm_unpackhi_epi16(ll, la));
+    }
+  }
+  expand_span_scalar(input + i * num_channels, num_channels, output + i, n - i);
+}
+
+// The byte order of a pixel is the same for the three and four channel
+// layouts, so one shuffle spreads four pixels
+template<bool swap>
+CANVAS_TARGET("ssse3")
+static void expand_rgb_span_ssse3(const unsigned char * input, unsigned int * output, size_t n) {
+  const __m128i alpha = _mm_set1_epi32(0xff000000);
+  const __m128i shuffle = swap ?
+    _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1) :
+    _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  size_t i = 0;
+  // the 16 byte loads read two pixels past the four that are used
+  for (; i + 6 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(input + 3 * i));
+    _mm_storeu_si128((__m128i *)(output + i), _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha));
+  }
+  expand_rgb_span_scalar<swap>(input + 3 * i, output + i, n - i);
+}
+
+CANVAS_TARGET("ssse3")
+static void expand_span_ssse3(const unsigned char * input, unsigned int num_channels, unsigned int * output, size_t n) {
+  if (num_channels == 3) expand_rgb_span_ssse3<false>(input, output, n);
+  else expand_span_sse2(input, num_channels, output, n);
+}
+
+template<bool swap>
+CANVAS_TARGET("avx2")
+static void expand_rgb_span_avx2(const unsigned char * input, unsigned int * output, size_t n) {
+  const __m256i alpha = _mm256_set1_epi32(0xff000000);
+  const __m256i shuffle = swap ?
+    _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1) :
+    _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  size_t i = 0;
+  // each lane takes four pixels, and the upper load reads two past them
+  for (; i + 10 <= n; i += 8) {
+    __m128i lo = _mm_loadu_si128((const __m128i *)(input + 3 * i));
+    __m128i hi = _mm_loadu_si128((const __m128i *)(input + 3 * i + 12));
+    __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+    _mm256_storeu_si256((__m256i *)(output + i), _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle), alpha));
+  }
+  expand_rgb_span_ssse3<swap>(input + 3 * i, output + i, n - i);
+}
+
+CANVAS_TARGET("avx2")
+static void expand_span_avx2(const unsigned char * input, unsigned int num_channels, unsigned int * output, size_t n) {
+  if (num_channels == 3) {
+    expand_rgb_span_avx2<false>(input, output, n);
+  } else if (num_channels == 1) {
+    const __m256i alpha = _mm256_set1_epi32(0xff000000);
+    const __m256i spread = _mm256_set1_epi32(0x010101);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+      __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(input + i)));
+      _mm256_storeu_si256((__m256i *)(output + i), _mm256_or_si256(_mm256_mullo_epi32(v, spread), alpha));
+    }
+    expand_span_sse2(input + i, num_channels, output + i, n - i);
+  } else {
+    expand_span_sse2(input, num_channels, output, n);
+  }
+}
+
+CANVAS_TARGET("sse2")
+static void swap_red_blue_span_sse2(const unsigned int * input, unsigned int * output, size_t n) {
+  const __m128i ag = _mm_set1_epi32(0xff00ff00), low = _mm_set1_epi32(0xff);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(input + i));
+    __m128i rb = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), low), _mm_slli_epi32(_mm_and_si128(v, low), 16));
+    _mm_storeu_si128((__m128i *)(output + i), _mm_or_si128(_mm_and_si128(v, ag), rb));
+  }
+  swap_red_blue_span_scalar(input + i, output + i, n - i);
+}
+
+CANVAS_TARGET("ssse3")
+static void swap_red_blue_span_ssse3(const unsigned int * input, unsigned int * output, size_t n) {
+  const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(input + i));
+    _mm_storeu_si128((__m128i *)(output + i), _mm_shuffle_epi8(v, shuffle));
+  }
+  swap_red_blue_span_scalar(input + i, output + i, n - i);
+}
+
+CANVAS_TARGET("avx2")
+static void swap_red_blue_span_avx2(const unsigned int * input, unsigned int * output, size_t n) {
+  const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+					   2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(input + i));
+    _mm256_storeu_si256((__m256i *)(output + i), _mm256_shuffle_epi8(v, shuffle));
+  }
+  swap_red_blue_span_ssse3(input + i, output + i, n - i);
+}
+
+// Two pixels in 16-bit lanes. x / 255 is (x + 1 + (x >> 8)) >> 8 for
+// all products x + 127 of two bytes.
+CANVAS_TARGET("sse2")
+static __m128i premultiply_pair_sse2(__m128i v) {
+  __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+  __m128i x = _mm_add_epi16(_mm_mullo_epi16(v, a), _mm_set1_epi16(127));
+  return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)), _mm_srli_epi16(x, 8)), 8);
+}
+
+CANVAS_TARGET("sse2")
+static void premultiply_span_sse2(const unsigned int * input, unsigned int * output, size_t n) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i alpha = _mm_set1_epi32(0xff000000);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(input + i));
+    __m128i r = _mm_packus_epi16(premultiply_pair_sse2(_mm_unpacklo_epi8(v, zero)), premultiply_pair_sse2(_mm_unpackhi_epi8(v, zero)));
+    _mm_storeu_si128((__m128i *)(output + i), _mm_or_si128(_mm_andnot_si128(alpha, r), _mm_and_si128(v, alpha)));
+  }
+  premultiply_span_scalar(input + i, output + i, n - i);
+}
+
+// One pixel in 32-bit lanes. The quotients of the float division are
+// within 1 / a of the next integer, far more than its error, so
+// truncating gives the same result as the integer division.
+CANVAS_TARGET("sse2")
+static __m128i unpremultiply_pixel_sse2(__m128i v) {
+  __m128i a = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3));
+  __m128i x = _mm_add_epi32(_mm_sub_epi32(_mm_slli_epi32(v, 8), v), _mm_srli_epi32(a, 1));
+  // transparent pixels are cleared afterwards, so avoid dividing by zero
+  __m128i d = _mm_or_si128(a, _mm_and_si128(_mm_cmpeq_epi32(a, _mm_setzero_si128()), _mm_set1_epi32(1)));
+  return _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(x), _mm_cvtepi32_ps(d)));
+}
+
+CANVAS_TARGET("sse2")
+static void unpremultiply_span_sse2(const unsigned int * input, unsigned int * output, size_t n) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i alpha = _mm_set1_epi32(0xff000000);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(input + i));
+    __m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+    // the packs saturate the quotients to 255
+    __m128i r = _mm_packus_epi16(_mm_packs_epi32(unpremultiply_pixel_sse2(_mm_unpacklo_epi16(lo, zero)), unpremultiply_pixel_sse2(_mm_unpackhi_epi16(lo, zero))),
+				 _mm_packs_epi32(unpremultiply_pixel_sse2(_mm_unpacklo_epi16(hi, zero)), unpremultiply_pixel_sse2(_mm_unpackhi_epi16(hi, zero))));
+    __m128i a = _mm_and_si128(v, alpha);
+    r = _mm_or_si128(_mm_andnot_si128(alpha, r), a);
+    _mm_storeu_si128((__m128i *)(output + i), _mm_andnot_si128(_mm_cmpeq_epi32(a, zero), r));
+  }
+  unpremultiply_span_scalar(input + i, output + i, n - i);
+}
+
+// The sums of three channels fit in 16 bits, and the high half of the
+// product with 21846 divides them by three exactly
+CANVAS_TARGET("sse2")
+static void pack_la44_span_sse2(const unsigned int * input, unsigned char * output, size_t n) {
+  const __m128i low = _mm_set1_epi32(0xff);
+  const __m128i third = _mm_set1_epi16(21846);
+  const __m128i high_nibble = _mm_set1_epi16(0xf0);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i v0 = _mm_loadu_si128((const __m128i *)(input + i));
+    __m128i v1 = _mm_loadu_si128((const __m128i *)(input + i + 4));
+    __m128i s0 = _mm_add_epi32(_mm_add_epi32(_mm_and_si128(v0, low), _mm_and_si128(_mm_srli_epi32(v0, 8), low)), _mm_and_si128(_mm_srli_epi32(v0, 16), low));
+    __m128i s1 = _mm_add_epi32(_mm_add_epi32(_mm_and_si128(v1, low), _mm_and_si128(_mm_srli_epi32(v1, 8), low)), _mm_and_si128(_mm_srli_epi32(v1, 16), low));
+    __m128i lum = _mm_srli_epi16(_mm_mulhi_epu16(_mm_packs_epi32(s0, s1), third), 4);
+    __m128i a = _mm_and_si128(_mm_packs_epi32(_mm_srli_epi32(v0, 24), _mm_srli_epi32(v1, 24)), high_nibble);
+    _mm_storel_epi64((__m128i *)(output + i), _mm_packus_epi16(_mm_or_si128(a, lum), a));
+  }
+  pack_la44_span_scalar(input + i, output + i, n - i);
+}
+#endif
+
+typedef void (*expand_span_func)(const unsigned char * input, unsigned int num_channels, unsigned int * output, size_t n);
+typedef void (*expand_rgb_span_func)(const unsigned char * input, unsigned int * output, size_t n);
+typedef void (*rgba32_span_func)(const unsigned int * input, unsigned int * output, size_t n);
+typedef void (*pack_la44_span_func)(const unsigned int * input, unsigned char * output, size_t n);
+
+static expand_span_func select_expand_span() {
+#ifdef CANVAS_HAS_X86
+  if (CpuFeatures::hasAVX2()) return expand_span_avx2;
+  if (CpuFeatures::hasSSSE3()) return expand_span_ssse3;
+  if (CpuFeatures::hasSSE2()) return expand_span_sse2;
+#endif
+  return expand_span_scalar;
+}
+
+static expand_rgb_span_func select_expand_rgb_to_bgra32_span() {
+#ifdef CANVAS_HAS_X86
+  if (CpuFeatures::hasAVX2()) return expand_rgb_span_avx2<true>;
+  if (CpuFeatures::hasSSSE3()) return expand_rgb_span_ssse3<true>;
+#endif
+  return expand_rgb_span_scalar<true>;
+}
+
+static rgba32_span_func select_swap_red_blue_span() {
+#ifdef CANVAS_HAS_X86
+  if (CpuFeatures::hasAVX2()) return swap_red_blue_span_avx2;
+  if (CpuFeatures::hasSSSE3()) return swap_red_blue_span_ssse3;
+  if (CpuFeatures::hasSSE2()) return swap_red_blue_span_sse2;
+#endif
+  return swap_red_blue_span_scalar;
+}
+
+static rgba32_span_func select_premultiply_span() {
+#ifdef CANVAS_HAS_X86
+  if (CpuFeatures::hasSSE2()) return premultiply_span_sse2;
+#endif
+  return premultiply_span_scalar;
+}
+
+static rgba32_span_func select_unpremultiply_span() {
+#ifdef CANVAS_HAS_X86
+  if (CpuFeatures::hasSSE2()) return unpremultiply_span_sse2;
+#endif
+  return unpremultiply_span_scalar;
+}
+
+static pack_la44_span_func select_pack_la44_span() {
+#ifdef CANVAS_HAS_X86
+  if (CpuFeatures::hasSSE2()) return pack_la44_span_sse2;
+#endif
+  return pack_la44_span_scalar;
+}
+
+void
+canvas::expand_to_rgba32_span(const unsigned char * input, unsigned int num_channels, unsigned int * output, size_t n) {
+  static expand_span_func f = select_expand_span();
+  f(input, num_channels, output, n);
+}
+
+void
+canvas::expand_rgb_to_bgra32_span(const unsigned char * input, unsigned int * output, size_t n) {
+  static expand_rgb_span_func f = select_expand_rgb_to_bgra32_span();
+  f(input, output, n);
+}
+
+void
+canvas::swap_red_blue_span(const unsigned int * input, unsigned int * output, size_t n) {
+  static rgba32_span_func f = select_swap_red_blue_span();
+  f(input, output, n);
+}
+
+void
+canvas::premultiply_span(const unsigned int * input, unsigned int * output, size_t n) {
+  static rgba32_span_func f = select_premultiply_span();
+  f(input, output, n);
+}
+
+void
+canvas::unpremultiply_span(const unsigned int * input, unsigned int * output, size_t n) {
+  static rgba32_span_func f = select_unpremultiply_span();
+  f(input, output, n);
+}
+
+void
+canvas::pack_la44_span(const unsigned int * input, unsigned char * output, size_t n) {
+  static pack_la44_span_func f = select_pack_la44_span();
+  f(input, output, n);
+}
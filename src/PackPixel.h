@@ -0,0 +1,152 @@
+#ifndef _PACKPIXEL_H_
+#define _PACKPIXEL_H_
+
+#include <InternalFormat.h>
+#include <ImageDataView.h>
+#include <ImageFormat.h>
+
+#include "CpuFeatures.h"
+
+#include <cstddef>
+
+namespace canvas {
+  // Packs an RGBA32 value (red in the lowest byte) to a 16-bit format
+  // by truncating the channels
+  template<InternalFormat F>
+  inline unsigned short pack_rgba32(unsigned int v) {
+    switch (F) {
+    case RGBA4:
+#if defined __APPLE__ || defined __ANDROID__
+      return ((RGBA_TO_RED(v) >> 4) << 12) | ((RGBA_TO_GREEN(v) >> 4) << 8) | ((RGBA_TO_BLUE(v) >> 4) << 4) | (RGBA_TO_ALPHA(v) >> 4);
+#else
+      return ((RGBA_TO_BLUE(v) >> 4) << 12) | ((RGBA_TO_GREEN(v) >> 4) << 8) | ((RGBA_TO_RED(v) >> 4) << 4) | (RGBA_TO_ALPHA(v) >> 4);
+#endif
+    case RGBA5551:
+      return PACK_RGBA5551(RGBA_TO_BLUE(v) >> 3, RGBA_TO_GREEN(v) >> 3, RGBA_TO_RED(v) >> 3, RGBA_TO_ALPHA(v) >> 7);
+    case RGB555:
+      return PACK_RGB555(RGBA_TO_BLUE(v) >> 3, RGBA_TO_GREEN(v) >> 3, RGBA_TO_RED(v) >> 3);
+    default:
+#if defined __APPLE__ || defined __ANDROID__
+      return PACK_RGB565(RGBA_TO_BLUE(v) >> 3, RGBA_TO_GREEN(v) >> 2, RGBA_TO_RED(v) >> 3);
+#else
+      return PACK_RGB565(RGBA_TO_RED(v) >> 3, RGBA_TO_GREEN(v) >> 2, RGBA_TO_BLUE(v) >> 3);
+#endif
+    }
+  }
+
+  // The bits of each RGBA32 channel that pack_rgba32 drops
+  template<InternalFormat F>
+  inline unsigned int packed_error_mask() {
+    switch (F) {
+    case RGBA4: return 0x0f0f0f0f;
+    case RGBA5551: return 0x7f070707;
+    case RGB555: return 0x00070707;
+    default: return 0x00070307; // RGB565
+    }
+  }
+
+#ifdef CANVAS_HAS_X86
+  // pack_rgba32 for the four RGBA32 values in each of v0 and v1
+  template<InternalFormat F>
+  CANVAS_TARGET("sse2")
+  inline __m128i pack_rgba32_sse2(__m128i v0, __m128i v1) {
+    __m128i p[2] = { v0, v1 };
+    for (int i = 0; i < 2; i++) {
+      __m128i v = p[i];
+      switch (F) {
+      case RGBA4:
+#if defined __APPLE__ || defined __ANDROID__
+	p[i] = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xf0)), 8),
+					 _mm_srli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xf000)), 4)),
+			    _mm_or_si128(_mm_srli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xf00000)), 16),
+					 _mm_srli_epi32(v, 28)));
+#else
+	p[i] = _mm_or_si128(_mm_or_si128(_mm_srli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xf00000)), 8),
+					 _mm_srli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xf000)), 4)),
+			    _mm_or_si128(_mm_and_si128(v, _mm_set1_epi32(0xf0)),
+					 _mm_srli_epi32(v, 28)));
+#endif
+	break;
+      case RGBA5551:
+      case RGB555:
+	p[i] = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 19), _mm_set1_epi32(0x1f)),
+					 _mm_and_si128(_mm_srli_epi32(v, 6), _mm_set1_epi32(0x3e0))),
+			    _mm_slli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xf8)), 7));
+	if (F == RGBA5551) p[i] = _mm_or_si128(p[i], _mm_and_si128(_mm_srli_epi32(v, 16), _mm_set1_epi32(0x8000)));
+	break;
+      default:
+#if defined __APPLE__ || defined __ANDROID__
+	p[i] = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 19), _mm_set1_epi32(0x1f)),
+					 _mm_srli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xfc00)), 5)),
+			    _mm_slli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xf8)), 8));
+#else
+	p[i] = _mm_or_si128(_mm_or_si128(_mm_srli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xf8)), 3),
+					 _mm_srli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xfc00)), 5)),
+			    _mm_srli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xf80000)), 8));
+#endif
+      }
+      // sign extend so that the signed pack keeps the 16-bit values
+      p[i] = _mm_srai_epi32(_mm_slli_epi32(p[i], 16), 16);
+    }
+    return _mm_packs_epi32(p[0], p[1]);
+  }
+#endif
+
+  // Divides the color channels of a premultiplied RGBA32 value by alpha
+  inline unsigned int unpremultiply_rgba32(unsigned int v) {
+    unsigned int a = RGBA_TO_ALPHA(v);
+    if (a == 255) return v;
+    if (a == 0) return 0;
+    unsigned int red = (RGBA_TO_RED(v) * 255 + a / 2) / a;
+    unsigned int green = (RGBA_TO_GREEN(v) * 255 + a / 2) / a;
+    unsigned int blue = (RGBA_TO_BLUE(v) * 255 + a / 2) / a;
+    return PACK_RGBA32(red > 255 ? 255 : red, green > 255 ? 255 : green, blue > 255 ? 255 : blue, a);
+  }
+
+  // Conversions of n pixels between the layouts used by the library,
+  // with the best instruction set selected at runtime. Four channel
+  // pixels are RGBA32, or native ARGB32 when the surface has that
+  // layout, since alpha is the fourth byte in both. The spans of four
+  // channel input and output may be the same.
+
+  // One channel is luminance, two are luminance and alpha, and three
+  // are RGB. The missing alpha is opaque.
+  void expand_to_rgba32_span(const unsigned char * input, unsigned int num_channels, unsigned int * output, size_t n);
+  // RGB to four channels with red and blue swapped and opaque alpha
+  void expand_rgb_to_bgra32_span(const unsigned char * input, unsigned int * output, size_t n);
+  void swap_red_blue_span(const unsigned int * input, unsigned int * output, size_t n);
+  // Multiply or divide the color channels by alpha, rounding to nearest
+  void premultiply_span(const unsigned int * input, unsigned int * output, size_t n);
+  void unpremultiply_span(const unsigned int * input, unsigned int * output, size_t n);
+  // Alpha in the high and average of the color channels in the low nibble
+  void pack_la44_span(const unsigned int * input, unsigned char * output, size_t n);
+
+  // Tells whether get_rgba32_row needs a buffer for converting rows
+  inline bool needs_rgba32_conversion(const ImageDataView & input, bool unpremultiply) {
+    return input.getNumChannels() != 4 || input.isBGRA() || unpremultiply;
+  }
+
+  // Returns a row as RGBA32, converting one to three channel rows, BGRA
+  // rows and, with unpremultiply set, four channel rows into converted,
+  // which must hold width values
+  inline const unsigned int * get_rgba32_row(const ImageDataView & input, unsigned int row, unsigned int * converted, bool unpremultiply = false) {
+    const unsigned char * data = input.getRow(row);
+    unsigned int width = input.getWidth(), num_channels = input.getNumChannels();
+    if (num_channels != 4) {
+      expand_to_rgba32_span(data, num_channels, converted, width);
+      if (unpremultiply && num_channels == 2) unpremultiply_span(converted, converted, width);
+      return converted;
+    } else if (input.isBGRA()) {
+      swap_red_blue_span((const unsigned int *)data, converted, width);
+      if (unpremultiply) unpremultiply_span(converted, converted, width);
+      return converted;
+    } else if (unpremultiply) {
+      unpremultiply_span((const unsigned int *)data, converted, width);
+      return converted;
+    } else {
+      return (const unsigned int *)data;
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,87 @@
+#include <PackedImageStream.h>
+
+#include <ImageDataView.h>
+#include <PackedImageData.h>
+
+#include "Mipmap.h"
+
+#include <cassert>
+#include <cstring>
+
+using namespace std;
+using namespace canvas;
+
+PackedImageStream::PackedImageStream(InternalFormat _format, unsigned int _width, unsigned int _height, unsigned int _num_channels, unsigned int _levels, Sink _sink, CompressionQuality _quality, DitherMode _dither, bool _premultiplied_output, bool _srgb_mipmaps, unsigned int _num_threads, unsigned int _band_rows)
+  : format(_format), width(_width), height(_height), num_channels(_num_channels), sink(_sink), quality(_quality), dither(_dither),
+    premultiplied_output(_premultiplied_output), srgb_mipmaps(_srgb_mipmaps), num_threads(_num_threads),
+    band_rows(_band_rows ? (_band_rows + 3) & ~3u : 4)
+{
+  assert(width && height && _levels);
+  unsigned int level_width = width, level_height = height;
+  for (unsigned int l = 0; l < _levels; l++) {
+    Level level;
+    level.width = level_width;
+    level.height = level_height;
+    level.band = PixelBuffer(size_t(level_width) * num_channels * band_rows, false);
+    levels.push_back(std::move(level));
+    level_width = (level_width + 1) / 2;
+    level_height = (level_height + 1) / 2;
+  }
+
+  // the first level has the largest bands
+  output = PixelBuffer(PackedImageData::calculateSize(width, band_rows, 1, format), false);
+}
+
+void
+PackedImageStream::addRows(const ImageDataView & rows) {
+  assert(rows.getWidth() == width && rows.getNumChannels() == num_channels);
+  assert(levels[0].next_row + rows.getHeight() <= height);
+  if (levels[0].next_row == 0) {
+    premultiplied_input = rows.isPremultiplied();
+    bgra_input = rows.isBGRA();
+  }
+  size_t row_size = size_t(width) * num_channels;
+  for (unsigned int row = 0; row < rows.getHeight(); row++) {
+    memcpy(getRowSlot(0), rows.getRow(row), row_size);
+    commitRow(0);
+  }
+}
+
+unsigned char *
+PackedImageStream::getRowSlot(unsigned int l) {
+  Level & level = levels[l];
+  return level.band.get() + size_t(level.next_row - level.band_start) * level.width * num_channels;
+}
+
+// The bands start at even rows, so both rows of a pair are in the
+// current band when the second one arrives
+void
+PackedImageStream::commitRow(unsigned int l) {
+  Level & level = levels[l];
+  level.next_row++;
+  if (l + 1 < levels.size() && (level.next_row % 2 == 0 || level.next_row == level.height)) {
+    size_t row_size = size_t(level.width) * num_channels;
+    const unsigned char * row1 = getRowSlot(l) - row_size;
+    const unsigned char * row0 = level.next_row % 2 == 0 ? row1 - row_size : row1;
+    int alpha_channel = num_channels == 4 ? 3 : (num_channels == 2 ? 1 : -1);
+    halve_span(row0, row1, getRowSlot(l + 1), level.width, num_channels, srgb_mipmaps, alpha_channel);
+    commitRow(l + 1);
+  }
+  if (level.next_row - level.band_start == band_rows || level.next_row == level.height) {
+    flush(l);
+  }
+}
+
+void
+PackedImageStream::flush(unsigned int l) {
+  Level & level = levels[l];
+  unsigned int rows = level.next_row - level.band_start;
+  ImageDataView input(level.band.get(), level.width, rows, num_channels, size_t(level.width) * num_channels, premultiplied_input, bgra_input);
+  bool unpremultiply = num_channels == 4 && premultiplied_input && !premultiplied_output;
+  PackedImageData::packRows(format, input, level.band_start, output.get(), quality, dither, unpremultiply, num_threads, &level.fs_state);
+
+  sink(l, output.get(), PackedImageData::calculateSize(level.width, rows, 1, format));
+
+  level.band_start = level.next_row;
+  if (level.next_row == level.height) level.fs_state.release();
+}
@@ -0,0 +1,40 @@
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include <thread>
+#include <vector>
+
+namespace canvas {
+  // Returns the number of worker threads to use, 0 meaning all hardware threads
+  inline unsigned int get_num_threads(unsigned int requested) {
+    if (!requested) {
+      requested = std::thread::hardware_concurrency();
+      if (!requested) requested = 1;
+    }
+    return requested;
+  }
+
+  // Splits [0, n) into contiguous ranges and calls f(begin, end) for
+  // each of them from its own thread. The calling thread processes the
+  // first range, and the call returns when all ranges are done.
+  template<class F>
+  void parallel_for(unsigned int n, unsigned int num_threads, F f) {
+    num_threads = get_num_threads(num_threads);
+    if (num_threads > n) num_threads = n;
+    if (num_threads <= 1) {
+      if (n) f(0u, n);
+      return;
+    }
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads - 1);
+    for (unsigned int i = 1; i < num_threads; i++) {
+      unsigned int begin = (unsigned long long)n * i / num_threads;
+      unsigned int end = (unsigned long long)n * (i + 1) / num_threads;
+      threads.push_back(std::thread(f, begin, end));
+    }
+    f(0u, (unsigned int)((unsigned long long)n / num_threads));
+    for (auto & t : threads) t.join();
+  }
+};
+
+#endif
@@ -0,0 +1,198 @@
+#include <PixelBuffer.h>
+
+#include <atomic>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+using namespace std;
+using namespace canvas;
+
+// Smallest size class; smaller requests share it
+#define PIXEL_POOL_MIN_SIZE 256
+
+unsigned char *
+PixelAllocator::allocateAligned(size_t size) {
+  if (!size) size = 1;
+#ifdef _WIN32
+  void * ptr = _aligned_malloc(size, PIXEL_BUFFER_ALIGNMENT);
+#else
+  void * ptr = 0;
+  if (posix_memalign(&ptr, PIXEL_BUFFER_ALIGNMENT, size) != 0) ptr = 0;
+#endif
+  if (!ptr) throw bad_alloc();
+  return (unsigned char *)ptr;
+}
+
+void
+PixelAllocator::freeAligned(unsigned char * ptr) {
+#ifdef _WIN32
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
+// The built-in allocator is never destroyed so that static images
+// can be released at any point during shutdown
+static PixelAllocator * getBuiltinAllocator() {
+  static PixelAllocator * allocator = new PooledPixelAllocator;
+  return allocator;
+}
+
+static atomic<PixelAllocator *> default_allocator(0);
+
+PixelAllocator &
+PixelAllocator::getDefault() {
+  PixelAllocator * a = default_allocator.load();
+  return a ? *a : *getBuiltinAllocator();
+}
+
+void
+PixelAllocator::setDefault(PixelAllocator * allocator) {
+  default_allocator.store(allocator);
+}
+
+PooledPixelAllocator::PooledPixelAllocator(size_t _max_cached_bytes, size_t _max_buffer_size)
+  : max_cached_bytes(_max_cached_bytes), max_buffer_size(_max_buffer_size)
+{
+  for (size_t base = PIXEL_POOL_MIN_SIZE; base <= max_buffer_size; base *= 2) {
+    for (size_t i = 0; i < 4 && base + i * base / 4 <= max_buffer_size; i++) {
+      Pool pool;
+      pool.size = base + i * base / 4;
+      pools.push_back(pool);
+    }
+  }
+}
+
+PooledPixelAllocator::~PooledPixelAllocator() {
+  trim(0);
+}
+
+int
+PooledPixelAllocator::getPool(size_t size) const {
+  if (size > max_buffer_size) return -1;
+  // the classes are sorted, so the first one that is large enough fits best
+  size_t low = 0, high = pools.size();
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    if (pools[mid].size < size) low = mid + 1;
+    else high = mid;
+  }
+  return low < pools.size() ? int(low) : -1;
+}
+
+unsigned char *
+PooledPixelAllocator::allocate(size_t size) {
+  int p = getPool(size);
+  if (p < 0) return allocateAligned(size);
+  {
+    lock_guard<mutex> guard(pool_mutex);
+    Pool & pool = pools[p];
+    pool.stats.allocations++;
+    if (!pool.free_buffers.empty()) {
+      unsigned char * ptr = pool.free_buffers.back();
+      pool.free_buffers.pop_back();
+      pool.stats.reuses++;
+      pool.stats.cached_buffers--;
+      pool.stats.cached_bytes -= pool.size;
+      cached_bytes -= pool.size;
+      return ptr;
+    }
+  }
+  return allocateAligned(pools[p].size);
+}
+
+void
+PooledPixelAllocator::deallocate(unsigned char * ptr, size_t size) {
+  int p = getPool(size);
+  if (p < 0) {
+    freeAligned(ptr);
+    return;
+  }
+  {
+    lock_guard<mutex> guard(pool_mutex);
+    Pool & pool = pools[p];
+    pool.stats.releases++;
+    if (cached_bytes + pool.size <= max_cached_bytes) {
+      pool.free_buffers.push_back(ptr);
+      pool.stats.cached_buffers++;
+      pool.stats.cached_bytes += pool.size;
+      cached_bytes += pool.size;
+      return;
+    }
+    pool.stats.discards++;
+  }
+  freeAligned(ptr);
+}
+
+void
+PooledPixelAllocator::trim() {
+  trim(0);
+}
+
+// Frees cached buffers, largest first, until at most limit bytes are cached
+void
+PooledPixelAllocator::trim(size_t limit) {
+  lock_guard<mutex> guard(pool_mutex);
+  for (size_t i = pools.size(); i > 0 && cached_bytes > limit; i--) {
+    Pool & pool = pools[i - 1];
+    while (!pool.free_buffers.empty() && cached_bytes > limit) {
+      freeAligned(pool.free_buffers.back());
+      pool.free_buffers.pop_back();
+      pool.stats.cached_buffers--;
+      pool.stats.cached_bytes -= pool.size;
+      cached_bytes -= pool.size;
+    }
+  }
+}
+
+void
+PooledPixelAllocator::setMaxCachedBytes(size_t n) {
+  {
+    lock_guard<mutex> guard(pool_mutex);
+    max_cached_bytes = n;
+  }
+  trim(n);
+}
+
+PooledPixelAllocator::Stats
+PooledPixelAllocator::getStats(unsigned int pool) const {
+  lock_guard<mutex> guard(pool_mutex);
+  return pools[pool].stats;
+}
+
+PooledPixelAllocator::Stats
+PooledPixelAllocator::getTotalStats() const {
+  lock_guard<mutex> guard(pool_mutex);
+  Stats total;
+  for (auto & pool : pools) {
+    total.allocations += pool.stats.allocations;
+    total.reuses += pool.stats.reuses;
+    total.releases += pool.stats.releases;
+    total.discards += pool.stats.discards;
+    total.cached_buffers += pool.stats.cached_buffers;
+    total.cached_bytes += pool.stats.cached_bytes;
+  }
+  return total;
+}
+
+void
+PooledPixelAllocator::resetStats() {
+  lock_guard<mutex> guard(pool_mutex);
+  for (auto & pool : pools) {
+    pool.stats.allocations = pool.stats.reuses = pool.stats.releases = pool.stats.discards = 0;
+  }
+}
+
+PixelBuffer::PixelBuffer(size_t _size, bool zero_fill, PixelAllocator & _allocator)
+  : data(0), size(_size), allocator(&_allocator)
+{
+  data = allocator->allocate(size);
+  if (zero_fill) memset(data, 0, size);
+}
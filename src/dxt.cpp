@@ -14,9 +14,15 @@
 //     you also see "(a*5 + b*3) / 8" on some old GPU designs.
 // #define STB_DXT_USE_ROUNDING_BIAS
 
+#include "CpuFeatures.h"
+
 #include <stdlib.h>
 #include <math.h>
 #include <string.h> // memset
+#include <assert.h>
+#ifdef STB_DXT_VERIFY_SIMD
+#include <stdio.h>
+#endif
 
 static unsigned char stb__Expand5[32];
 static unsigned char stb__Expand6[64];
@@ -224,19 +230,64 @@ static inline unsigned int stb__MatchColorsBlock(unsigned char *block, unsigned
    return mask;
 }
 
+// Finds the principal axis of the color distribution from the
+// covariance matrix by power iteration, scaled to integer weights
+static inline void stb__PrincipalAxis(const int *cov, const int *min, const int *max, int *pv_r, int *pv_g, int *pv_b) {
+  double magn;
+  int v_r,v_g,v_b;
+  static const int nIterPower = 4;
+  float covf[6],vfr,vfg,vfb;
+  int i,iter;
+
+  // convert covariance matrix to float, find principal axis via power iter
+  for(i=0;i<6;i++)
+    covf[i] = cov[i] / 255.0f;
+
+  vfr = (float) (max[0] - min[0]);
+  vfg = (float) (max[1] - min[1]);
+  vfb = (float) (max[2] - min[2]);
+
+  for(iter=0;iter<nIterPower;iter++)
+  {
+    float r = vfr*covf[0] + vfg*covf[1] + vfb*covf[2];
+    float g = vfr*covf[1] + vfg*covf[3] + vfb*covf[4];
+    float b = vfr*covf[2] + vfg*covf[4] + vfb*covf[5];
+
+    vfr = r;
+    vfg = g;
+    vfb = b;
+  }
+
+  magn = fabs(vfr);
+  if (fabs(vfg) > magn) magn = fabs(vfg);
+  if (fabs(vfb) > magn) magn = fabs(vfb);
+
+   if(magn < 4.0f) { // too small, default to luminance
+      v_r = 299; // JPEG YCbCr luma coefs, scaled by 1000.
+      v_g = 587;
+      v_b = 114;
+   } else {
+      magn = 512.0 / magn;
+      v_r = (int) (vfr * magn);
+      v_g = (int) (vfg * magn);
+      v_b = (int) (vfb * magn);
+   }
+
+   *pv_r = v_r;
+   *pv_g = v_g;
+   *pv_b = v_b;
+}
+
 // The color optimization function. (Clever code, part 1)
 static inline void stb__OptimizeColorsBlock(unsigned char *block, unsigned short *pmax16, unsigned short *pmin16) {
   int mind = 0x7fffffff,maxd = -0x7fffffff;
   unsigned char *minp, *maxp;
-  double magn;
   int v_r,v_g,v_b;
-  static const int nIterPower = 4;
-  float covf[6],vfr,vfg,vfb;
 
   // determine color distribution
   int cov[6];
   int mu[3],min[3],max[3];
-  int ch,i,iter;
+  int ch,i;
 
   for(ch=0;ch<3;ch++)
   {
@@ -274,39 +325,7 @@ static inline void stb__OptimizeColorsBlock(unsigned char *block, unsigned short
     cov[5] += b*b;
   }
 
-  // convert covariance matrix to float, find principal axis via power iter
-  for(i=0;i<6;i++)
-    covf[i] = cov[i] / 255.0f;
-
-  vfr = (float) (max[0] - min[0]);
-  vfg = (float) (max[1] - min[1]);
-  vfb = (float) (max[2] - min[2]);
-
-  for(iter=0;iter<nIterPower;iter++)
-  {
-    float r = vfr*covf[0] + vfg*covf[1] + vfb*covf[2];
-    float g = vfr*covf[1] + vfg*covf[3] + vfb*covf[4];
-    float b = vfr*covf[2] + vfg*covf[4] + vfb*covf[5];
-
-    vfr = r;
-    vfg = g;
-    vfb = b;
-  }
-
-  magn = fabs(vfr);
-  if (fabs(vfg) > magn) magn = fabs(vfg);
-  if (fabs(vfb) > magn) magn = fabs(vfb);
-
-   if(magn < 4.0f) { // too small, default to luminance
-      v_r = 299; // JPEG YCbCr luma coefs, scaled by 1000.
-      v_g = 587;
-      v_b = 114;
-   } else {
-      magn = 512.0 / magn;
-      v_r = (int) (vfr * magn);
-      v_g = (int) (vfg * magn);
-      v_b = (int) (vfb * magn);
-   }
+  stb__PrincipalAxis(cov, min, max, &v_r, &v_g, &v_b);
 
    // Pick colors at extreme points
    for(i=0;i<16;i++)
@@ -417,6 +436,26 @@ static inline int stb__RefineBlock(unsigned char *block, unsigned short *pmax16,
    return oldMin != min16 || oldMax != max16;
 }
 
+// write the color block
+static inline void stb__WriteColorBlock(unsigned char *dest, unsigned short max16, unsigned short min16, unsigned int mask) {
+  if(max16 < min16)
+  {
+     unsigned short t = min16;
+     min16 = max16;
+     max16 = t;
+     mask ^= 0x55555555;
+  }
+
+  dest[0] = (unsigned char) (max16);
+  dest[1] = (unsigned char) (max16 >> 8);
+  dest[2] = (unsigned char) (min16);
+  dest[3] = (unsigned char) (min16 >> 8);
+  dest[4] = (unsigned char) (mask);
+  dest[5] = (unsigned char) (mask >> 8);
+  dest[6] = (unsigned char) (mask >> 16);
+  dest[7] = (unsigned char) (mask >> 24);
+}
+
 // Color block compression
 static inline void stb__CompressColorBlock(unsigned char *dest, unsigned char *block, int mode) {
    unsigned int mask;
@@ -471,23 +510,253 @@ static inline void stb__CompressColorBlock(unsigned char *dest, unsigned char *b
       }
   }
 
-  // write the color block
-  if(max16 < min16)
-  {
-     unsigned short t = min16;
-     min16 = max16;
-     max16 = t;
-     mask ^= 0x55555555;
+  stb__WriteColorBlock(dest,max16,min16,mask);
+}
+
+#ifdef CANVAS_HAS_X86
+// SSE2 version of the color block compressor. The per pixel work
+// (color statistics, covariance, projections and index selection) is
+// done for all 16 pixels at once, while the power iteration and the
+// least squares refinement share the scalar code, so the output is
+// identical to stb__CompressColorBlock. Dithering uses the scalar code.
+
+// Splits the RGB channels of the 16 pixels into 16-bit planes, pixels
+// 0-7 in the first register and 8-15 in the second
+CANVAS_TARGET("sse2")
+static inline void stb__LoadPlanesSSE2(const unsigned char *block, __m128i *r, __m128i *g, __m128i *b) {
+  const __m128i ff = _mm_set1_epi32(0xff);
+  for (int h = 0; h < 2; h++) {
+    __m128i p0 = _mm_loadu_si128((const __m128i *)(block + 32 * h));
+    __m128i p1 = _mm_loadu_si128((const __m128i *)(block + 32 * h + 16));
+    r[h] = _mm_packs_epi32(_mm_and_si128(p0, ff), _mm_and_si128(p1, ff));
+    g[h] = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), ff), _mm_and_si128(_mm_srli_epi32(p1, 8), ff));
+    b[h] = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), ff), _mm_and_si128(_mm_srli_epi32(p1, 16), ff));
   }
+}
 
-  dest[0] = (unsigned char) (max16);
-  dest[1] = (unsigned char) (max16 >> 8);
-  dest[2] = (unsigned char) (min16);
-  dest[3] = (unsigned char) (min16 >> 8);
-  dest[4] = (unsigned char) (mask);
-  dest[5] = (unsigned char) (mask >> 8);
-  dest[6] = (unsigned char) (mask >> 16);
-  dest[7] = (unsigned char) (mask >> 24);
+CANVAS_TARGET("sse2")
+static inline int stb__HSum32SSE2(__m128i v) {
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1,0,3,2)));
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2,3,0,1)));
+  return _mm_cvtsi128_si32(v);
+}
+
+// sum of the products of two pairs of 16-bit planes
+CANVAS_TARGET("sse2")
+static inline int stb__DotSSE2(const __m128i *a, const __m128i *b) {
+  return stb__HSum32SSE2(_mm_add_epi32(_mm_madd_epi16(a[0], b[0]), _mm_madd_epi16(a[1], b[1])));
+}
+
+CANVAS_TARGET("sse2")
+static inline int stb__HMin16SSE2(__m128i v) {
+  v = _mm_min_epi16(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1,0,3,2)));
+  v = _mm_min_epi16(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2,3,0,1)));
+  v = _mm_min_epi16(v, _mm_srli_epi32(v, 16));
+  return (short) _mm_cvtsi128_si32(v);
+}
+
+CANVAS_TARGET("sse2")
+static inline int stb__HMax16SSE2(__m128i v) {
+  v = _mm_max_epi16(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1,0,3,2)));
+  v = _mm_max_epi16(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2,3,0,1)));
+  v = _mm_max_epi16(v, _mm_srli_epi32(v, 16));
+  return (short) _mm_cvtsi128_si32(v);
+}
+
+// r*wr + g*wg + b*wb for the 16 pixels as 32-bit values, four per register
+CANVAS_TARGET("sse2")
+static inline void stb__ProjectSSE2(const __m128i *r, const __m128i *g, const __m128i *b, int wr, int wg, int wb, __m128i *dots) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i wrg = _mm_set_epi16(wg, wr, wg, wr, wg, wr, wg, wr);
+  const __m128i wb0 = _mm_set_epi16(0, wb, 0, wb, 0, wb, 0, wb);
+  for (int h = 0; h < 2; h++) {
+    dots[2 * h + 0] = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r[h], g[h]), wrg), _mm_madd_epi16(_mm_unpacklo_epi16(b[h], zero), wb0));
+    dots[2 * h + 1] = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r[h], g[h]), wrg), _mm_madd_epi16(_mm_unpackhi_epi16(b[h], zero), wb0));
+  }
+}
+
+// one bit per pixel for the 32-bit comparison results
+CANVAS_TARGET("sse2")
+static inline unsigned int stb__MoveMaskSSE2(const __m128i *m) {
+  return _mm_movemask_epi8(_mm_packs_epi16(_mm_packs_epi32(m[0], m[1]), _mm_packs_epi32(m[2], m[3])));
+}
+
+// moves bit i to bit 2i
+static inline unsigned int stb__SpreadBits(unsigned int x) {
+  x = (x | (x << 8)) & 0x00ff00ff;
+  x = (x | (x << 4)) & 0x0f0f0f0f;
+  x = (x | (x << 2)) & 0x33333333;
+  x = (x | (x << 1)) & 0x55555555;
+  return x;
+}
+
+static inline int stb__FirstBit(unsigned int x) {
+  int i = 0;
+  while (!(x & 1)) {
+    x >>= 1;
+    i++;
+  }
+  return i;
+}
+
+CANVAS_TARGET("sse2")
+static inline void stb__OptimizeColorsBlockSSE2(const unsigned char *block, const __m128i *r, const __m128i *g, const __m128i *b, unsigned short *pmax16, unsigned short *pmin16) {
+  const __m128i ones = _mm_set1_epi16(1);
+  const __m128i *planes[3] = { r, g, b };
+  __m128i d[3][2];
+  int cov[6];
+  int mu[3],min[3],max[3];
+  int v_r,v_g,v_b;
+
+  for (int ch = 0; ch < 3; ch++) {
+    const __m128i *p = planes[ch];
+    int muv = stb__HSum32SSE2(_mm_add_epi32(_mm_madd_epi16(p[0], ones), _mm_madd_epi16(p[1], ones)));
+    mu[ch] = (muv + 8) >> 4;
+    min[ch] = stb__HMin16SSE2(_mm_min_epi16(p[0], p[1]));
+    max[ch] = stb__HMax16SSE2(_mm_max_epi16(p[0], p[1]));
+    __m128i m = _mm_set1_epi16((short) mu[ch]);
+    d[ch][0] = _mm_sub_epi16(p[0], m);
+    d[ch][1] = _mm_sub_epi16(p[1], m);
+  }
+
+  cov[0] = stb__DotSSE2(d[0], d[0]);
+  cov[1] = stb__DotSSE2(d[0], d[1]);
+  cov[2] = stb__DotSSE2(d[0], d[2]);
+  cov[3] = stb__DotSSE2(d[1], d[1]);
+  cov[4] = stb__DotSSE2(d[1], d[2]);
+  cov[5] = stb__DotSSE2(d[2], d[2]);
+
+  stb__PrincipalAxis(cov, min, max, &v_r, &v_g, &v_b);
+
+  // the first pixels with the smallest and the largest projection
+  __m128i dots[4];
+  stb__ProjectSSE2(r, g, b, v_r, v_g, v_b, dots);
+  __m128i vmin = dots[0], vmax = dots[0];
+  for (int i = 1; i < 4; i++) {
+    __m128i lt = _mm_cmplt_epi32(dots[i], vmin);
+    __m128i gt = _mm_cmpgt_epi32(dots[i], vmax);
+    vmin = _mm_or_si128(_mm_and_si128(lt, dots[i]), _mm_andnot_si128(lt, vmin));
+    vmax = _mm_or_si128(_mm_and_si128(gt, dots[i]), _mm_andnot_si128(gt, vmax));
+  }
+  for (int i = 0; i < 2; i++) {
+    // the shuffle control must be an immediate at any optimization level
+    __m128i smin = i ? _mm_shuffle_epi32(vmin, _MM_SHUFFLE(2,3,0,1)) : _mm_shuffle_epi32(vmin, _MM_SHUFFLE(1,0,3,2));
+    __m128i smax = i ? _mm_shuffle_epi32(vmax, _MM_SHUFFLE(2,3,0,1)) : _mm_shuffle_epi32(vmax, _MM_SHUFFLE(1,0,3,2));
+    __m128i lt = _mm_cmplt_epi32(smin, vmin);
+    __m128i gt = _mm_cmpgt_epi32(smax, vmax);
+    vmin = _mm_or_si128(_mm_and_si128(lt, smin), _mm_andnot_si128(lt, vmin));
+    vmax = _mm_or_si128(_mm_and_si128(gt, smax), _mm_andnot_si128(gt, vmax));
+  }
+  __m128i eqmin[4], eqmax[4];
+  for (int i = 0; i < 4; i++) {
+    eqmin[i] = _mm_cmpeq_epi32(dots[i], vmin);
+    eqmax[i] = _mm_cmpeq_epi32(dots[i], vmax);
+  }
+  const unsigned char *minp = block + 4 * stb__FirstBit(stb__MoveMaskSSE2(eqmin));
+  const unsigned char *maxp = block + 4 * stb__FirstBit(stb__MoveMaskSSE2(eqmax));
+
+  *pmax16 = stb__As16Bit(maxp[0],maxp[1],maxp[2]);
+  *pmin16 = stb__As16Bit(minp[0],minp[1],minp[2]);
+}
+
+CANVAS_TARGET("sse2")
+static inline unsigned int stb__MatchColorsBlockSSE2(const __m128i *r, const __m128i *g, const __m128i *b, const unsigned char *color) {
+  int dirr = color[0*4+0] - color[1*4+0];
+  int dirg = color[0*4+1] - color[1*4+1];
+  int dirb = color[0*4+2] - color[1*4+2];
+  int stops[4];
+
+  for (int i = 0; i < 4; i++)
+    stops[i] = color[i*4+0]*dirr + color[i*4+1]*dirg + color[i*4+2]*dirb;
+
+  __m128i c0Point = _mm_set1_epi32((stops[1] + stops[3]) >> 1);
+  __m128i halfPoint = _mm_set1_epi32((stops[3] + stops[2]) >> 1);
+  __m128i c3Point = _mm_set1_epi32((stops[2] + stops[0]) >> 1);
+
+  __m128i dots[4], lt_half[4], lt_c0[4], lt_c3[4];
+  stb__ProjectSSE2(r, g, b, dirr, dirg, dirb, dots);
+  for (int i = 0; i < 4; i++) {
+    lt_half[i] = _mm_cmplt_epi32(dots[i], halfPoint);
+    lt_c0[i] = _mm_cmplt_epi32(dots[i], c0Point);
+    lt_c3[i] = _mm_cmplt_epi32(dots[i], c3Point);
+  }
+  unsigned int half = stb__MoveMaskSSE2(lt_half);
+  unsigned int c0 = stb__MoveMaskSSE2(lt_c0);
+  unsigned int c3 = stb__MoveMaskSSE2(lt_c3);
+
+  // below half: 1 or 3 depending on c0Point, otherwise 2 or 0 depending on c3Point
+  unsigned int high = (half & ~c0) | (~half & c3);
+  return stb__SpreadBits(half) | (stb__SpreadBits(high & 0xffff) << 1);
+}
+
+CANVAS_TARGET("sse2")
+static void stb__CompressColorBlockSSE2(unsigned char *dest, unsigned char *block, int mode) {
+   if (mode & STB_DXT_DITHER) {
+      stb__CompressColorBlock(dest, block, mode);
+      return;
+   }
+   
+   unsigned int mask;
+   int i;
+   int refinecount = (mode & STB_DXT_HIGHQUAL) ? 2 : 1;
+   unsigned short max16, min16;
+   unsigned char color[4*4];
+
+   __m128i p0 = _mm_loadu_si128((const __m128i *)block);
+   __m128i first = _mm_shuffle_epi32(p0, 0);
+   __m128i eq = _mm_cmpeq_epi32(p0, first);
+   for (i = 1; i < 4; i++)
+      eq = _mm_and_si128(eq, _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(block + 16 * i)), first));
+   
+   if (_mm_movemask_epi8(eq) == 0xffff) { // constant color
+      int r = block[0], g = block[1], b = block[2];
+      mask  = 0xaaaaaaaa;
+      max16 = (stb__OMatch5[r][0]<<11) | (stb__OMatch6[g][0]<<5) | stb__OMatch5[b][0];
+      min16 = (stb__OMatch5[r][1]<<11) | (stb__OMatch6[g][1]<<5) | stb__OMatch5[b][1];
+   } else {
+      __m128i r[2], g[2], b[2];
+      stb__LoadPlanesSSE2(block, r, g, b);
+      
+      stb__OptimizeColorsBlockSSE2(block,r,g,b,&max16,&min16);
+      if (max16 != min16) {
+         stb__EvalColors(color,max16,min16);
+         mask = stb__MatchColorsBlockSSE2(r,g,b,color);
+      } else
+         mask = 0;
+
+      for (i=0;i<refinecount;i++) {
+         unsigned int lastmask = mask;
+         
+         if (stb__RefineBlock(block,&max16,&min16,mask)) {
+            if (max16 != min16) {
+               stb__EvalColors(color,max16,min16);
+               mask = stb__MatchColorsBlockSSE2(r,g,b,color);
+            } else {
+               mask = 0;
+               break;
+            }
+         }
+         
+         if(mask == lastmask)
+            break;
+      }
+   }
+
+   stb__WriteColorBlock(dest,max16,min16,mask);
+}
+#endif
+
+typedef void (*stb__ColorBlockFunc)(unsigned char *dest, unsigned char *block, int mode);
+
+static void stb__CompressColorBlockDefault(unsigned char *dest, unsigned char *block, int mode) {
+  stb__CompressColorBlock(dest, block, mode);
+}
+
+static stb__ColorBlockFunc stb__SelectColorBlock() {
+#ifdef CANVAS_HAS_X86
+  if (canvas::CpuFeatures::hasSSE2()) return stb__CompressColorBlockSSE2;
+#endif
+  return stb__CompressColorBlockDefault;
 }
 
 // Alpha block compression (this is easy for a change)
@@ -543,6 +812,7 @@ static inline void stb__CompressAlphaBlock(unsigned char *dest,unsigned char *sr
 }
 
 // Red block compression (this is easy for a change)
+// Reads 16 contiguous values
 static inline void stb__CompressRGTCBlock(unsigned char *dest, unsigned char *src) {
   int i,dist,bias,dist4,dist2,bits,mask;
   
@@ -571,7 +841,7 @@ static inline void stb__CompressRGTCBlock(unsigned char *dest, unsigned char *sr
   bits = 0,mask=0;
   
   for (i=0;i<16;i++) {
-    int a = src[i*2+0]*7 + bias;
+    int a = src[i]*7 + bias;
     int ind,t;
     
     // select index. this is a "linear scale" lerp factor between 0 (val=min) and 7 (val=max).
@@ -611,38 +881,41 @@ static void stb__InitDXT() {
   stb__PrepareOptTable(&stb__OMatch6[0][0],stb__Expand6,64);
 }
 
-static int init=1;
+// Thread safe one time initialization of the tables
+static void stb__EnsureInit() {
+  static const bool initialized = (stb__InitDXT(), true);
+  (void)initialized;
+}
 
 void stb_compress_dxt1_block(unsigned char *dest, const unsigned char *src, bool alpha, int mode) {
-  if (init) {
-    stb__InitDXT();
-    init=0;
-  }
+  stb__EnsureInit();
   
   if (alpha) {
     stb__CompressAlphaBlock(dest,(unsigned char*) src,mode);
     dest += 8;
   }
   
-  stb__CompressColorBlock(dest,(unsigned char*) src,mode);
+  static stb__ColorBlockFunc compress_color = stb__SelectColorBlock();
+  compress_color(dest,(unsigned char*) src,mode);
+#ifdef STB_DXT_VERIFY_SIMD
+  unsigned char reference[8];
+  stb__CompressColorBlock(reference,(unsigned char*) src,mode);
+  if (memcmp(dest, reference, 8) != 0) {
+    fprintf(stderr, "stb_dxt: SIMD color block differs from the scalar compressor\n");
+    abort();
+  }
+#endif
 }
 
 void stb_compress_rgtc1_block(unsigned char *dest, const unsigned char *src) {
-  if (init) {
-    stb__InitDXT();
-    init = 0;
-  } 
+  stb__EnsureInit();
   stb__CompressRGTCBlock(dest, (unsigned char*) src);
 }
 
 void stb_compress_rgtc2_block(unsigned char *dest, const unsigned char *src) {
-  if (init) {
-    stb__InitDXT();
-    init=0;
-  }
-
+  stb__EnsureInit();
   stb__CompressRGTCBlock(dest, (unsigned char*) src);
   dest += 8;
-  stb__CompressRGTCBlock(dest, (unsigned char*) src + 256);
+  stb__CompressRGTCBlock(dest, (unsigned char*) src + 16);
   dest += 8;   
 }
@@ -31,7 +31,13 @@
 #define STB_DXT_DITHER    1   // use dithering. dubious win. never use for normal maps and the like!
 #define STB_DXT_HIGHQUAL  2   // high quality mode, does two refinement steps instead of 1. ~30-40% slower.
 
+// The color blocks are compressed with SIMD when the CPU supports it.
+// Define STB_DXT_VERIFY_SIMD when building dxt.cpp to check every
+// block against the scalar compressor. A mismatch is reported and
+// aborts, also in release builds.
+
 void stb_compress_dxt1_block(unsigned char *dest, const unsigned char *src, bool alpha, int mode);
+// src holds 16 values for rgtc1 and two planes of 16 values for rgtc2
 void stb_compress_rgtc1_block(unsigned char *dest, const unsigned char *src);
 void stb_compress_rgtc2_block(unsigned char *dest, const unsigned char *src);
 
@@ -0,0 +1,21 @@
+#ifndef _BENCHMARK_H_
+#define _BENCHMARK_H_
+
+#include <chrono>
+
+// Runs f until at least min_seconds have passed and returns the
+// fastest run in seconds
+template<class F>
+double benchmark(F f, double min_seconds = 0.5) {
+  double best = 0.0, total = 0.0;
+  for (unsigned int i = 0; i == 0 || total < min_seconds; i++) {
+    auto t0 = std::chrono::steady_clock::now();
+    f();
+    double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    if (i == 0 || t < best) best = t;
+    total += t;
+  }
+  return best;
+}
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef _CHECK_H_
+#define _CHECK_H_
+
+#include <cstdio>
+
+// Counts failed checks, and main returns the count so that ctest
+// reports any failure
+static int check_failures = 0;
+
+#define CHECK(cond) do {						\
+    if (!(cond)) {							\
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      check_failures++;							\
+    }									\
+  } while (0)
+
+#endif
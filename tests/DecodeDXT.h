@@ -0,0 +1,52 @@
+#ifndef _DECODEDXT_H_
+#define _DECODEDXT_H_
+
+// Reference decoders for the DXT blocks, as a GPU samples them
+
+// Expands 5 or 6 bit values by repeating the high bits
+static inline unsigned char expand_bits(unsigned int v, unsigned int bits) {
+  return (unsigned char)((v << (8 - bits)) | (v >> (2 * bits - 8)));
+}
+
+// Decodes a DXT color block to 16 pixels of three channels in RGB
+// order. The endpoints are 565 colors with red in the high bits.
+static inline void decode_color_block(const unsigned char * block, bool dxt1, unsigned char * pixels) {
+  unsigned int c0 = block[0] | (block[1] << 8), c1 = block[2] | (block[3] << 8);
+  int colors[4][3];
+  for (unsigned int i = 0; i < 2; i++) {
+    unsigned int c = i ? c1 : c0;
+    colors[i][0] = expand_bits(c >> 11, 5);
+    colors[i][1] = expand_bits((c >> 5) & 63, 6);
+    colors[i][2] = expand_bits(c & 31, 5);
+  }
+  for (unsigned int ch = 0; ch < 3; ch++) {
+    if (!dxt1 || c0 > c1) {
+      colors[2][ch] = (2 * colors[0][ch] + colors[1][ch]) / 3;
+      colors[3][ch] = (colors[0][ch] + 2 * colors[1][ch]) / 3;
+    } else {
+      colors[2][ch] = (colors[0][ch] + colors[1][ch]) / 2;
+      colors[3][ch] = 0;
+    }
+  }
+  unsigned int indices = block[4] | (block[5] << 8) | (block[6] << 16) | ((unsigned int)block[7] << 24);
+  for (unsigned int i = 0; i < 16; i++) {
+    for (unsigned int ch = 0; ch < 3; ch++) pixels[i * 3 + ch] = (unsigned char)colors[(indices >> (2 * i)) & 3][ch];
+  }
+}
+
+// Decodes the 8 byte alpha block of DXT5 to 16 values
+static inline void decode_alpha_block(const unsigned char * block, unsigned char * values) {
+  int a[8] = { block[0], block[1] };
+  if (a[0] > a[1]) {
+    for (int i = 1; i < 7; i++) a[i + 1] = ((7 - i) * a[0] + i * a[1]) / 7;
+  } else {
+    for (int i = 1; i < 5; i++) a[i + 1] = ((5 - i) * a[0] + i * a[1]) / 5;
+    a[6] = 0;
+    a[7] = 255;
+  }
+  unsigned long long indices = 0;
+  for (int i = 0; i < 6; i++) indices |= (unsigned long long)block[2 + i] << (8 * i);
+  for (unsigned int i = 0; i < 16; i++) values[i] = (unsigned char)a[(indices >> (3 * i)) & 7];
+}
+
+#endif
@@ -0,0 +1,36 @@
+// Throughput of the kernel blur on 4K wide images. The vertical pass
+// alone is measured separately, since its cost depends on how well the
+// rows of a strip stay in the cache.
+
+#include <ImageData.h>
+
+#include "Benchmark.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace canvas;
+
+int main(int argc, char ** argv) {
+  unsigned int num_threads = argc > 1 ? atoi(argv[1]) : 1;
+  const unsigned int width = 3840, height = 512;
+
+  printf("%-10s %2s %6s %12s %12s\n", "size", "ch", "radius", "vertical", "both");
+  for (unsigned int num_channels : { 1, 4 }) {
+    ImageData image(width, height, num_channels, false);
+    unsigned char * data = image.getData();
+    unsigned int seed = 1;
+    for (size_t i = 0; i < image.calculateSize(); i++) {
+      seed = seed * 1103515245 + 12345;
+      data[i] = seed >> 24;
+    }
+
+    for (float radius : { 2.0f, 8.0f, 32.0f }) {
+      double vertical = benchmark([&]() { image.blur(0.0f, radius, KERNEL_BLUR, num_threads); });
+      double both = benchmark([&]() { image.blur(radius, radius, KERNEL_BLUR, num_threads); });
+      double mpix = width * height / 1e6;
+      printf("%4ux%-5u %2u %6g %7.1f MP/s %7.1f MP/s\n", width, height, num_channels, radius, mpix / vertical, mpix / both);
+    }
+  }
+  return 0;
+}
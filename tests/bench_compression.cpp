@@ -0,0 +1,104 @@
+// Speed and quality of the block compressed formats at each
+// compression quality. The blocks are decoded again to measure the
+// PSNR of the color (and for DXT5 also alpha) channels.
+
+#include <ImageData.h>
+#include <PackedImageData.h>
+
+#include "Benchmark.h"
+#include "DecodeDXT.h"
+#include "rg_etc1.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace canvas;
+
+static double psnr(double squared_error, double n) {
+  return squared_error ? 10.0 * log10(255.0 * 255.0 * n / squared_error) : 99.0;
+}
+
+// Returns the PSNR of the decoded level against the input
+static double measure_psnr(const PackedImageData & packed, const ImageData & image) {
+  InternalFormat format = packed.getInternalFormat();
+  unsigned int width = image.getWidth(), height = image.getHeight();
+  unsigned int cols = (width + 3) / 4, rows = (height + 3) / 4;
+  size_t block_size = format == RGBA_DXT5 ? 16 : 8;
+  unsigned int channels = format == RGBA_DXT5 ? 4 : 3;
+  double error = 0.0;
+  for (unsigned int row = 0; row < rows; row++) {
+    for (unsigned int col = 0; col < cols; col++) {
+      const unsigned char * block = packed.getData() + (size_t(row) * cols + col) * block_size;
+      // decoded pixels in RGBA order
+      unsigned char decoded[16 * 4];
+      if (format == RGB_ETC1) {
+	rg_etc1::unpack_etc1_block(block, (unsigned int *)decoded);
+      } else {
+	unsigned char color[16 * 3], alpha[16];
+	decode_color_block(format == RGBA_DXT5 ? block + 8 : block, format == RGB_DXT1, color);
+	if (format == RGBA_DXT5) decode_alpha_block(block, alpha);
+	for (unsigned int i = 0; i < 16; i++) {
+	  decoded[i * 4 + 0] = color[i * 3 + 0];
+	  decoded[i * 4 + 1] = color[i * 3 + 1];
+	  decoded[i * 4 + 2] = color[i * 3 + 2];
+	  decoded[i * 4 + 3] = format == RGBA_DXT5 ? alpha[i] : 255;
+	}
+      }
+      for (unsigned int i = 0; i < 16; i++) {
+	unsigned int x = col * 4 + i % 4, y = row * 4 + i / 4;
+	if (x >= width || y >= height) continue;
+	const unsigned char * p = image.getData() + y * image.getBytesPerRow() + x * 4;
+	for (unsigned int ch = 0; ch < channels; ch++) {
+	  double d = double(decoded[i * 4 + ch]) - p[ch];
+	  error += d * d;
+	}
+      }
+    }
+  }
+  return psnr(error, double(width) * height * channels);
+}
+
+// Smooth gradients, edges and noise, with an alpha ramp. The colors
+// are premultiplied so that packing leaves them unchanged.
+static void create_test_image(ImageData & image) {
+  unsigned char * data = image.getData();
+  unsigned int seed = 1;
+  for (unsigned int y = 0; y < image.getHeight(); y++) {
+    for (unsigned int x = 0; x < image.getWidth(); x++) {
+      seed = seed * 1103515245 + 12345;
+      int noise = int((seed >> 24) % 17) - 8;
+      double r = 128 + 100 * sin(x * 0.02) * cos(y * 0.03) + noise;
+      double g = (x / 64 + y / 64) % 2 ? 200 - y * 0.1 : 40 + x * 0.1;
+      double b = 255.0 * x / image.getWidth() + noise;
+      unsigned int a = 255 - (y * 191 / image.getHeight());
+      unsigned char * p = data + y * image.getBytesPerRow() + x * 4;
+      p[0] = (unsigned char)(fmin(fmax(r, 0), 255) * a / 255);
+      p[1] = (unsigned char)(fmin(fmax(g, 0), 255) * a / 255);
+      p[2] = (unsigned char)(fmin(fmax(b, 0), 255) * a / 255);
+      p[3] = (unsigned char)a;
+    }
+  }
+}
+
+int main(int argc, char ** argv) {
+  unsigned int num_threads = argc > 1 ? atoi(argv[1]) : 1;
+  const unsigned int width = 256, height = 256;
+  ImageData image(width, height, 4, false);
+  create_test_image(image);
+  ImageDataView view(image);
+
+  static const InternalFormat formats[] = { RGB_ETC1, RGB_DXT1, RGBA_DXT5 };
+  static const char * format_names[] = { "RGB_ETC1", "RGB_DXT1", "RGBA_DXT5" };
+  static const char * quality_names[] = { "fast", "normal", "high" };
+
+  printf("%-10s %-7s %12s %9s\n", "format", "quality", "speed", "PSNR");
+  for (unsigned int f = 0; f < 3; f++) {
+    for (int quality = COMPRESSION_FAST; quality <= COMPRESSION_HIGH; quality++) {
+      std::unique_ptr<PackedImageData> packed;
+      double t = benchmark([&]() { packed.reset(new PackedImageData(formats[f], 1, view, CompressionQuality(quality), DITHER_FLOYD_STEINBERG, true, false, num_threads)); }, 1.0);
+      printf("%-10s %-7s %7.2f MP/s %6.2f dB\n", format_names[f], quality_names[quality], width * height / 1e6 / t, measure_psnr(*packed, image));
+    }
+  }
+  return 0;
+}
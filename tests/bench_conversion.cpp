@@ -0,0 +1,47 @@
+// Throughput of the pixel conversion kernels on rows of 4096 pixels,
+// which stay in the cache. The benchmark is also built against the
+// scalar fallbacks for comparison.
+
+#include "Benchmark.h"
+#include "PackPixel.h"
+
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+using namespace std;
+using namespace canvas;
+
+int main() {
+  const size_t n = 4096;
+  const unsigned int iterations = 256;
+  vector<unsigned char> bytes(n * 4);
+  vector<unsigned int> input(n), output(n);
+  unsigned int seed = 1;
+  for (size_t i = 0; i < n; i++) {
+    seed = seed * 1103515245 + 12345;
+    input[i] = seed;
+  }
+  for (size_t i = 0; i < bytes.size(); i++) bytes[i] = (unsigned char)(i * 7 + (i >> 5));
+
+  struct Kernel {
+    const char * name;
+    function<void()> f;
+  };
+  Kernel kernels[] = {
+    { "expand gray", [&]() { expand_to_rgba32_span(&bytes[0], 1, &output[0], n); } },
+    { "expand gray+alpha", [&]() { expand_to_rgba32_span(&bytes[0], 2, &output[0], n); } },
+    { "expand rgb", [&]() { expand_to_rgba32_span(&bytes[0], 3, &output[0], n); } },
+    { "expand rgb to bgra", [&]() { expand_rgb_to_bgra32_span(&bytes[0], &output[0], n); } },
+    { "swap red and blue", [&]() { swap_red_blue_span(&input[0], &output[0], n); } },
+    { "premultiply", [&]() { premultiply_span(&input[0], &output[0], n); } },
+    { "unpremultiply", [&]() { unpremultiply_span(&input[0], &output[0], n); } },
+    { "pack la44", [&]() { pack_la44_span(&input[0], &bytes[0], n); } },
+  };
+
+  for (const Kernel & kernel : kernels) {
+    double t = benchmark([&]() { for (unsigned int i = 0; i < iterations; i++) kernel.f(); }, 0.25);
+    printf("%-20s %8.1f MP/s\n", kernel.name, n * iterations / 1e6 / t);
+  }
+  return 0;
+}
@@ -0,0 +1,67 @@
+// Prints a checksum of DXT1 and DXT5 data packed at each compression
+// quality. It is built against the SIMD and the scalar library, and
+// the test compares the output of the two.
+
+#include <ImageData.h>
+#include <PackedImageData.h>
+
+#include <cstdio>
+
+using namespace canvas;
+
+// 64-bit FNV-1a
+static unsigned long long checksum(const unsigned char * data, size_t size) {
+  unsigned long long h = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; i++) {
+    h ^= data[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// Noise, smooth gradients, flat areas and hard edges, so that the
+// blocks take every path of the color block compressor
+static void create_test_image(ImageData & image) {
+  unsigned int seed = 1;
+  for (unsigned int y = 0; y < image.getHeight(); y++) {
+    unsigned char * p = image.getData() + y * image.getBytesPerRow();
+    for (unsigned int x = 0; x < image.getWidth(); x++, p += 4) {
+      seed = seed * 1103515245 + 12345;
+      unsigned int noise = seed >> 24;
+      unsigned int a = 255 - y * 191 / image.getHeight();
+      unsigned int r, g, b;
+      if (y < image.getHeight() / 3) {
+	r = noise;
+	g = (noise * 7 + x) & 255;
+	b = (x * 3 + y) & 255;
+      } else if (y < 2 * image.getHeight() / 3) {
+	r = x * 255 / image.getWidth();
+	g = (x / 8 + y / 8) % 2 ? 255 : 0;
+	b = 128;
+      } else {
+	r = g = b = (x / 16) % 2 ? 200 : 40;
+      }
+      p[0] = (unsigned char)(r * a / 255);
+      p[1] = (unsigned char)(g * a / 255);
+      p[2] = (unsigned char)(b * a / 255);
+      p[3] = (unsigned char)a;
+    }
+  }
+}
+
+int main() {
+  ImageData image(517, 389, 4, false);
+  create_test_image(image);
+  image.setPremultiplied(true);
+  ImageDataView view(image);
+
+  static const InternalFormat formats[] = { RGB_DXT1, RGBA_DXT5 };
+  static const char * format_names[] = { "RGB_DXT1", "RGBA_DXT5" };
+  for (unsigned int f = 0; f < 2; f++) {
+    for (int quality = COMPRESSION_FAST; quality <= COMPRESSION_HIGH; quality++) {
+      PackedImageData packed(formats[f], 3, view, CompressionQuality(quality));
+      printf("%s %d %016llx\n", format_names[f], quality, checksum(packed.getData(), packed.calculateSize()));
+    }
+  }
+  return 0;
+}
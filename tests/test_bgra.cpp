@@ -0,0 +1,75 @@
+// Four channel views in BGRA order, like locked Cairo surfaces, must
+// pack to the same data as the same colors in RGBA order.
+
+#include <ImageData.h>
+#include <PackedImageData.h>
+#include <PackedImageStream.h>
+
+#include "Check.h"
+
+#include <cstring>
+#include <vector>
+
+using namespace std;
+using namespace canvas;
+
+static vector<unsigned char> pack_stream(InternalFormat format, const ImageDataView & input, unsigned int levels, DitherMode dither, bool premultiplied_output) {
+  vector<unsigned char> output(PackedImageData::calculateSize(input.getWidth(), input.getHeight(), levels, format));
+  vector<size_t> offsets;
+  for (unsigned int l = 0; l < levels; l++) offsets.push_back(PackedImageData::calculateOffset(input.getWidth(), input.getHeight(), l, format));
+  PackedImageStream stream(format, input.getWidth(), input.getHeight(), 4, levels, [&](unsigned int level, const unsigned char * data, size_t size) {
+      memcpy(&output[offsets[level]], data, size);
+      offsets[level] += size;
+    }, COMPRESSION_FAST, dither, premultiplied_output, false, 1, 8);
+  for (unsigned int row = 0; row < input.getHeight(); row += 5) {
+    unsigned int rows = row + 5 < input.getHeight() ? 5 : input.getHeight() - row;
+    stream.addRows(ImageDataView(input.getRow(row), input.getWidth(), rows, 4, input.getBytesPerRow(), input.isPremultiplied(), input.isBGRA()));
+  }
+  CHECK(stream.isComplete());
+  return output;
+}
+
+int main() {
+  const unsigned int width = 37, height = 21, levels = 3;
+  ImageData rgba(width, height, 4, false);
+  vector<unsigned char> bgra(rgba.calculateSize());
+  unsigned int seed = 1;
+  for (size_t i = 0; i < rgba.calculateSize(); i += 4) {
+    unsigned char * p = rgba.getData() + i;
+    for (unsigned int c = 0; c < 4; c++) {
+      seed = seed * 1103515245 + 12345;
+      p[c] = seed >> 24;
+    }
+    for (unsigned int c = 0; c < 3; c++) p[c] = p[c] * p[3] / 255;
+  }
+  // an opaque red pixel in the corner
+  memcpy(rgba.getData(), "\xff\x00\x00\xff", 4);
+  for (size_t i = 0; i < bgra.size(); i += 4) {
+    const unsigned char * p = rgba.getData() + i;
+    bgra[i + 0] = p[2];
+    bgra[i + 1] = p[1];
+    bgra[i + 2] = p[0];
+    bgra[i + 3] = p[3];
+  }
+  ImageDataView rgba_view(rgba);
+  ImageDataView bgra_view(&bgra[0], width, height, 4, 0, true, true);
+  CHECK(bgra_view.isBGRA() && !rgba_view.isBGRA());
+
+  PackedImageData red(RGBA8, 1, bgra_view);
+  CHECK(!memcmp(red.getData(), "\xff\x00\x00\xff", 4));
+
+  static const InternalFormat formats[] = { RGBA8, RGB8, RGBA4, RGB565, RGB555, RGBA5551, LA44, RGB_ETC1, RGB_DXT1, RGBA_DXT5, RED_RGTC1, RG_RGTC2 };
+  static const DitherMode dithers[] = { DITHER_FLOYD_STEINBERG, DITHER_BAYER, DITHER_BLUE_NOISE };
+  for (InternalFormat format : formats) {
+    for (DitherMode dither : dithers) {
+      for (bool premultiplied_output : { true, false }) {
+	PackedImageData expected(format, levels, rgba_view, COMPRESSION_FAST, dither, premultiplied_output);
+	PackedImageData packed(format, levels, bgra_view, COMPRESSION_FAST, dither, premultiplied_output);
+	CHECK(!memcmp(packed.getData(), expected.getData(), expected.calculateSize()));
+	vector<unsigned char> streamed = pack_stream(format, bgra_view, levels, dither, premultiplied_output);
+	CHECK(!memcmp(&streamed[0], expected.getData(), expected.calculateSize()));
+      }
+    }
+  }
+  return check_failures;
+}
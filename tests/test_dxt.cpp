@@ -0,0 +1,95 @@
+// DXT blocks must decode to the colors that were packed, with red in
+// the high bits of the endpoints, from RGBA and from BGRA views. DXT5
+// must also keep the alpha.
+
+#include <ImageData.h>
+#include <PackedImageData.h>
+
+#include "Check.h"
+#include "DecodeDXT.h"
+
+#include <cstdlib>
+#include <vector>
+
+using namespace std;
+using namespace canvas;
+
+// 4x4 blocks: red, green, blue, orange, one that is half red and half
+// blue, and a white one with an alpha ramp
+static const unsigned char block_colors[6][2][3] = {
+  { { 255, 0, 0 }, { 255, 0, 0 } },
+  { { 0, 255, 0 }, { 0, 255, 0 } },
+  { { 0, 0, 255 }, { 0, 0, 255 } },
+  { { 255, 128, 0 }, { 255, 128, 0 } },
+  { { 255, 0, 0 }, { 0, 0, 255 } },
+  { { 255, 255, 255 }, { 255, 255, 255 } },
+};
+
+// The expected colors are not premultiplied, and the input is packed
+// without premultiplied alpha
+static void test_decode(InternalFormat format, const ImageDataView & input, const ImageData & expected) {
+  PackedImageData packed(format, 1, input, COMPRESSION_FAST, DITHER_FLOYD_STEINBERG, false);
+  size_t block_size = format == RGBA_DXT5 ? 16 : 8;
+  for (unsigned int col = 0; col < expected.getWidth() / 4; col++) {
+    const unsigned char * block = packed.getData() + col * block_size;
+    unsigned char color[16 * 3];
+    unsigned char alpha[16];
+    decode_color_block(format == RGBA_DXT5 ? block + 8 : block, format == RGB_DXT1, color);
+    if (format == RGBA_DXT5) decode_alpha_block(block, alpha);
+    int max_diff = 0;
+    for (unsigned int i = 0; i < 16; i++) {
+      const unsigned char * p = expected.getData() + (i / 4) * expected.getBytesPerRow() + (col * 4 + i % 4) * 4;
+      for (unsigned int ch = 0; ch < 3; ch++) {
+	int d = abs(int(color[i * 3 + ch]) - int(p[ch]));
+	if (d > max_diff) max_diff = d;
+      }
+      if (format == RGBA_DXT5) {
+	int d = abs(int(alpha[i]) - int(p[3]));
+	if (d > max_diff) max_diff = d;
+      }
+    }
+    CHECK(max_diff <= 8);
+  }
+}
+
+int main() {
+  const unsigned int num_blocks = sizeof(block_colors) / sizeof(block_colors[0]);
+  const unsigned int width = num_blocks * 4, height = 4;
+  ImageData expected(width, height, 4, false);
+  ImageData rgba(width, height, 4, false);
+  vector<unsigned char> bgra(rgba.calculateSize());
+  for (unsigned int y = 0; y < height; y++) {
+    for (unsigned int x = 0; x < width; x++) {
+      const unsigned char * c = block_colors[x / 4][x % 4 < 2 ? 0 : 1];
+      unsigned int a = x / 4 == num_blocks - 1 ? 255 - (y * 4 + x % 4) * 4 : 255;
+      unsigned char * e = expected.getData() + y * expected.getBytesPerRow() + x * 4;
+      unsigned char * p = rgba.getData() + y * rgba.getBytesPerRow() + x * 4;
+      unsigned char * q = &bgra[y * rgba.getBytesPerRow() + x * 4];
+      e[0] = c[0];
+      e[1] = c[1];
+      e[2] = c[2];
+      e[3] = (unsigned char)a;
+      p[0] = q[2] = (unsigned char)(c[0] * a / 255);
+      p[1] = q[1] = (unsigned char)(c[1] * a / 255);
+      p[2] = q[0] = (unsigned char)(c[2] * a / 255);
+      p[3] = q[3] = (unsigned char)a;
+    }
+  }
+  rgba.setPremultiplied(true);
+  ImageDataView rgba_view(rgba);
+  ImageDataView bgra_view(&bgra[0], width, height, 4, 0, true, true);
+
+  // an opaque red block has red as the first endpoint
+  PackedImageData red(RGB_DXT1, 1, rgba_view, COMPRESSION_FAST);
+  CHECK((red.getData()[0] | (red.getData()[1] << 8)) == 0xf800);
+
+  // and so does the color block of DXT5
+  PackedImageData red5(RGBA_DXT5, 1, rgba_view, COMPRESSION_FAST);
+  CHECK((red5.getData()[8] | (red5.getData()[9] << 8)) == 0xf800);
+
+  for (const ImageDataView * input : { &rgba_view, &bgra_view }) {
+    test_decode(RGB_DXT1, *input, expected);
+    test_decode(RGBA_DXT5, *input, expected);
+  }
+  return check_failures;
+}
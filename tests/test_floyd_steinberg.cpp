@@ -0,0 +1,260 @@
+// Compares the Floyd-Steinberg dithering with a copy of the original
+// implementation, which used per-row vectors and no SIMD. The output
+// must be identical for every target format, for one, three and four
+// channel input at odd sizes, and for the serial, banded and wavefront
+// paths. The test is built twice, with and without SIMD kernels.
+
+#include <FloydSteinberg.h>
+#include <ImageData.h>
+#include <ImageFormat.h>
+#include <PixelBuffer.h>
+
+#include "Check.h"
+#include "PackPixel.h"
+
+#include <cstring>
+#include <vector>
+
+using namespace std;
+using namespace canvas;
+
+// The original implementation, for four channel RGBA32 input
+
+struct rgba_s {
+  rgba_s() : red(0), green(0), blue(0), alpha(0) { }
+  rgba_s(unsigned int _red, unsigned int _green, unsigned int _blue, unsigned int _alpha = 0) : red(_red), green(_green), blue(_blue), alpha(_alpha) { }
+  unsigned int red;
+  unsigned int green;
+  unsigned int blue;
+  unsigned int alpha;
+
+  inline void setError(unsigned int weight, unsigned int error) {
+    red = (weight * RGBA_TO_RED(error)) >> 4;
+    green = (weight * RGBA_TO_GREEN(error)) >> 4;
+    blue = (weight * RGBA_TO_BLUE(error)) >> 4;
+  }
+
+  inline void addError(unsigned int weight, unsigned int error) {
+    red += (weight * RGBA_TO_RED(error)) >> 4;
+    green += (weight * RGBA_TO_GREEN(error)) >> 4;
+    blue += (weight * RGBA_TO_BLUE(error)) >> 4;
+  }
+
+  inline void setErrorAlpha(unsigned int weight, unsigned int error) {
+    red = (weight * RGBA_TO_RED(error)) >> 4;
+    green = (weight * RGBA_TO_GREEN(error)) >> 4;
+    blue = (weight * RGBA_TO_BLUE(error)) >> 4;
+    alpha = (weight * RGBA_TO_ALPHA(error)) >> 4;
+  }
+
+  inline void addErrorAlpha(unsigned int weight, unsigned int error) {
+    red += (weight * RGBA_TO_RED(error)) >> 4;
+    green += (weight * RGBA_TO_GREEN(error)) >> 4;
+    blue += (weight * RGBA_TO_BLUE(error)) >> 4;
+    alpha += (weight * RGBA_TO_ALPHA(error)) >> 4;
+  }
+};
+
+static size_t reference_apply(const unsigned char * input_data, size_t input_stride, unsigned int width, unsigned int height, InternalFormat target_format, unsigned char * output_data, size_t bytesPerRow) {
+  if (target_format == RGBA4) {
+    vector<rgba_s> old_errors(width + 2);
+    for (unsigned int y = 0; y < height; y++) {
+      vector<rgba_s> new_errors(width + 2);
+      rgba_s next_error;
+      const unsigned int * input = (const unsigned int *)(input_data + y * input_stride);
+      unsigned short * output_row = (unsigned short *)(output_data + y * bytesPerRow);
+      for (unsigned int x = 0; x < width; x++, input++) {
+        unsigned int v0 = *input;
+        unsigned int red = RGBA_TO_RED(v0) + next_error.red + old_errors[x + 1].red;
+        unsigned int green = RGBA_TO_GREEN(v0) + next_error.green + old_errors[x + 1].green;
+        unsigned int blue = RGBA_TO_BLUE(v0) + next_error.blue + old_errors[x + 1].blue;
+        unsigned int alpha = RGBA_TO_ALPHA(v0) + next_error.alpha + old_errors[x + 1].alpha;
+        if (red > 255) red = 255;
+        if (green > 255) green = 255;
+        if (blue > 255) blue = 255;
+        if (alpha > 255) alpha = 255;
+        unsigned int v = PACK_RGBA32(red, green, blue, alpha);
+        unsigned int error = v & 0x0f0f0f0f;
+#if defined __APPLE__ || defined __ANDROID__
+        *output_row++ = ((RGBA_TO_RED(v) >> 4) << 12) | ((RGBA_TO_GREEN(v) >> 4) << 8) | ((RGBA_TO_BLUE(v) >> 4) << 4) | (RGBA_TO_ALPHA(v) >> 4);
+#else
+        *output_row++ = ((RGBA_TO_BLUE(v) >> 4) << 12) | ((RGBA_TO_GREEN(v) >> 4) << 8) | ((RGBA_TO_RED(v) >> 4) << 4) | (RGBA_TO_ALPHA(v) >> 4);
+#endif
+        next_error.setErrorAlpha(7, error);
+        new_errors[x].addErrorAlpha(3, error);
+        new_errors[x + 1].addErrorAlpha(5, error);
+        new_errors[x + 2].addErrorAlpha(1, error);
+      }
+      old_errors.swap(new_errors);
+    }
+  } else if (target_format == RGBA5551) {
+    vector<rgba_s> old_errors(width + 2);
+    for (unsigned int y = 0; y < height; y++) {
+      vector<rgba_s> new_errors(width + 2);
+      rgba_s next_error;
+      const unsigned int * input = (const unsigned int *)(input_data + y * input_stride);
+      unsigned short * output_row = (unsigned short *)(output_data + y * bytesPerRow);
+      for (unsigned int x = 0; x < width; x++, input++) {
+        unsigned int v0 = *input;
+        unsigned int red = RGBA_TO_RED(v0) + next_error.red + old_errors[x + 1].red;
+        unsigned int green = RGBA_TO_GREEN(v0) + next_error.green + old_errors[x + 1].green;
+        unsigned int blue = RGBA_TO_BLUE(v0) + next_error.blue + old_errors[x + 1].blue;
+        unsigned int alpha = RGBA_TO_ALPHA(v0) + next_error.alpha + old_errors[x + 1].alpha;
+        if (red > 255) red = 255;
+        if (green > 255) green = 255;
+        if (blue > 255) blue = 255;
+        if (alpha > 255) alpha = 255;
+        unsigned int v = PACK_RGBA32(red, green, blue, alpha);
+        unsigned int error = v & 0x7f070707;
+        *output_row++ = PACK_RGBA5551(RGBA_TO_BLUE(v) >> 3, RGBA_TO_GREEN(v) >> 3, RGBA_TO_RED(v) >> 3, RGBA_TO_ALPHA(v) >> 7);
+        next_error.setErrorAlpha(7, error);
+        new_errors[x].addErrorAlpha(3, error);
+        new_errors[x + 1].addErrorAlpha(5, error);
+        new_errors[x + 2].addErrorAlpha(1, error);
+      }
+      old_errors.swap(new_errors);
+    }
+  } else if (target_format == RGB555) {
+    vector<rgba_s> old_errors(width + 2);
+    for (unsigned int y = 0; y < height; y++) {
+      vector<rgba_s> new_errors(width + 2);
+      rgba_s next_error;
+      const unsigned int * input = (const unsigned int *)(input_data + y * input_stride);
+      unsigned short * output_row = (unsigned short *)(output_data + y * bytesPerRow);
+      for (unsigned int x = 0; x < width; x++) {
+	unsigned int v0 = *input++;
+	unsigned int red = RGBA_TO_RED(v0) + next_error.red + old_errors[x + 1].red;
+	unsigned int green = RGBA_TO_GREEN(v0) + next_error.green + old_errors[x + 1].green;
+	unsigned int blue = RGBA_TO_BLUE(v0) + next_error.blue + old_errors[x + 1].blue;
+	if (red > 255) red = 255;
+	if (green > 255) green = 255;
+	if (blue > 255) blue = 255;
+	unsigned int v = PACK_RGB24(red, green, blue);
+	unsigned int error = v & 0x00070707;
+	*output_row++ = PACK_RGB555(RGBA_TO_BLUE(v) >> 3, RGBA_TO_GREEN(v) >> 3, RGBA_TO_RED(v) >> 3);
+        
+	next_error.setError(7, error);
+	new_errors[x].addError(3, error);
+	new_errors[x + 1].addError(5, error);
+	new_errors[x + 2].addError(1, error);
+      }
+      old_errors.swap(new_errors);
+    }
+  } else {
+    vector<rgba_s> old_errors(width + 2);
+    for (unsigned int y = 0; y < height; y++) {
+      vector<rgba_s> new_errors(width + 2);
+      rgba_s next_error;
+      const unsigned int * input = (const unsigned int *)(input_data + y * input_stride);
+      unsigned short * output_row = (unsigned short *)(output_data + y * bytesPerRow);
+      for (unsigned int x = 0; x < width; x++, input++) {
+        unsigned int v0 = *input;
+        unsigned int red = RGBA_TO_RED(v0) + next_error.red + old_errors[x + 1].red;
+        unsigned int green = RGBA_TO_GREEN(v0) + next_error.green + old_errors[x + 1].green;
+        unsigned int blue = RGBA_TO_BLUE(v0) + next_error.blue + old_errors[x + 1].blue;
+        if (red > 255) red = 255;
+        if (green > 255) green = 255;
+        if (blue > 255) blue = 255;
+        unsigned int v = PACK_RGB24(red, green, blue);
+        unsigned int error = v & 0x00070307;
+#if defined __APPLE__ || defined __ANDROID__
+        *output_row++ = PACK_RGB565(RGBA_TO_BLUE(v) >> 3, RGBA_TO_GREEN(v) >> 2, RGBA_TO_RED(v) >> 3);
+#else
+        *output_row++ = PACK_RGB565(RGBA_TO_RED(v) >> 3, RGBA_TO_GREEN(v) >> 2, RGBA_TO_BLUE(v) >> 3);
+#endif
+        next_error.setError(7, error);
+        new_errors[x].addError(3, error);
+        new_errors[x + 1].addError(5, error);
+        new_errors[x + 2].addError(1, error);
+      }
+      old_errors.swap(new_errors);
+    }
+  }
+  return size_t(width) * height * 2;
+}
+
+// Converts the input to RGBA32 like the original implementation did,
+// dividing the color by alpha if requested
+static vector<unsigned int> to_rgba32(const ImageDataView & input, bool unpremultiply) {
+  vector<unsigned int> pixels;
+  for (unsigned int row = 0; row < input.getHeight(); row++) {
+    const unsigned char * data = input.getRow(row);
+    for (unsigned int x = 0; x < input.getWidth(); x++) {
+      const unsigned char * p = data + x * input.getNumChannels();
+      unsigned int v;
+      if (input.getNumChannels() == 4) {
+	v = PACK_RGBA32(p[0], p[1], p[2], p[3]);
+	if (unpremultiply) v = unpremultiply_rgba32(v);
+      } else if (input.getNumChannels() == 3) {
+	v = (0xff << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+      } else {
+	v = (0xff << 24) | (p[0] << 16) | (p[0] << 8) | p[0];
+      }
+      pixels.push_back(v);
+    }
+  }
+  return pixels;
+}
+
+static void test_dither(InternalFormat format, unsigned int width, unsigned int height, unsigned int num_channels, bool unpremultiply) {
+  // rows are padded to test the stride
+  size_t stride = size_t(width) * num_channels + 5;
+  vector<unsigned char> input(stride * height);
+  unsigned int seed = width * 7 + height * 3 + num_channels;
+  for (size_t i = 0; i < input.size(); i++) {
+    seed = seed * 1103515245 + 12345;
+    input[i] = i % 13 == 0 ? 255 : seed >> 24;
+  }
+  if (num_channels == 4) {
+    // valid premultiplied colors
+    for (unsigned int row = 0; row < height; row++) {
+      unsigned char * p = &input[row * stride];
+      for (unsigned int x = 0; x < width; x++, p += 4) {
+	for (unsigned int c = 0; c < 3; c++) p[c] = p[c] * p[3] / 255;
+      }
+    }
+  }
+  ImageDataView view(&input[0], width, height, num_channels, stride);
+
+  size_t bytesPerRow = size_t(width) * 2 + 6;
+  vector<unsigned char> expected(bytesPerRow * height), output(bytesPerRow * height);
+  vector<unsigned int> rgba32 = to_rgba32(view, unpremultiply);
+  reference_apply((const unsigned char *)&rgba32[0], size_t(width) * 4, width, height, format, &expected[0], bytesPerRow);
+
+  FloydSteinberg fs(format, unpremultiply);
+  for (unsigned int num_threads : { 1, 2, 3, 4 }) {
+    memset(&output[0], 0, output.size());
+    CHECK(fs.apply(view, &output[0], bytesPerRow, num_threads) == size_t(width) * height * 2);
+    CHECK(output == expected);
+  }
+
+  // bands of a few rows that carry the error in the state
+  for (unsigned int band_rows : { 1, 4, 7 }) {
+    memset(&output[0], 0, output.size());
+    PixelBuffer state;
+    for (unsigned int row = 0; row < height; row += band_rows) {
+      unsigned int rows = row + band_rows < height ? band_rows : height - row;
+      ImageDataView band(view.getRow(row), width, rows, num_channels, stride);
+      fs.apply(band, &output[row * bytesPerRow], bytesPerRow, state);
+    }
+    CHECK(output == expected);
+  }
+}
+
+int main() {
+  static const InternalFormat formats[] = { RGBA4, RGBA5551, RGB555, RGB565 };
+  for (InternalFormat format : formats) {
+    for (unsigned int num_channels : { 1, 3, 4 }) {
+      for (unsigned int width : { 1, 2, 3, 7, 17, 64, 333 }) {
+	test_dither(format, width, 1 + width % 7 + 3, num_channels, false);
+      }
+      // large enough for the wavefront
+      test_dither(format, 1023, 301, num_channels, false);
+      if (num_channels == 4) {
+	test_dither(format, 333, 9, num_channels, true);
+	test_dither(format, 1023, 301, num_channels, true);
+      }
+    }
+  }
+  return check_failures;
+}
@@ -0,0 +1,50 @@
+// Threaded scaling resizes bands of rows separately. The result may
+// differ from a single call by one, but no more, and any thread count
+// must give the same size and cover every row.
+
+#include <ImageData.h>
+
+#include "Check.h"
+
+#include <cstdlib>
+
+using namespace canvas;
+
+static void test_scale(unsigned int width, unsigned int height, unsigned int target_width, unsigned int target_height, unsigned int num_channels, ResizeFilter filter, ResizeEdge edge) {
+  ImageData image(width, height, num_channels, false);
+  unsigned char * data = image.getData();
+  unsigned int seed = width * 31 + num_channels;
+  for (size_t i = 0; i < image.calculateSize(); i++) {
+    seed = seed * 1103515245 + 12345;
+    data[i] = seed >> 24;
+  }
+
+  auto single = image.scale(target_width, target_height, filter, edge, 1);
+  for (unsigned int num_threads : { 2, 3, 8 }) {
+    auto banded = image.scale(target_width, target_height, filter, edge, num_threads);
+    CHECK(banded->getWidth() == target_width && banded->getHeight() == target_height);
+    int max_diff = 0;
+    for (size_t i = 0; i < single->calculateSize(); i++) {
+      int d = abs(int(single->getData()[i]) - int(banded->getData()[i]));
+      if (d > max_diff) max_diff = d;
+    }
+    CHECK(max_diff <= 1);
+  }
+}
+
+int main() {
+  for (unsigned int num_channels : { 1, 4 }) {
+    for (int filter = RESIZE_FILTER_DEFAULT; filter <= RESIZE_FILTER_MITCHELL; filter++) {
+      test_scale(640, 360, 960, 541, num_channels, ResizeFilter(filter), RESIZE_EDGE_CLAMP);
+      test_scale(960, 540, 640, 361, num_channels, ResizeFilter(filter), RESIZE_EDGE_CLAMP);
+      test_scale(389, 499, 257, 725, num_channels, ResizeFilter(filter), RESIZE_EDGE_CLAMP);
+      test_scale(1000, 1000, 350, 401, num_channels, ResizeFilter(filter), RESIZE_EDGE_CLAMP);
+    }
+    // the edge modes decide what the first and last bands read
+    for (int edge = RESIZE_EDGE_CLAMP; edge <= RESIZE_EDGE_ZERO; edge++) {
+      test_scale(500, 800, 400, 600, num_channels, RESIZE_FILTER_DEFAULT, ResizeEdge(edge));
+      test_scale(300, 200, 450, 301, num_channels, RESIZE_FILTER_DEFAULT, ResizeEdge(edge));
+    }
+  }
+  return check_failures;
+}
@@ -0,0 +1,97 @@
+// Images with rows of more than 65535 bytes or pixels, and byte sizes
+// that do not fit in 32 bits
+
+#include <ImageData.h>
+#include <PackedImageData.h>
+
+#include "Check.h"
+
+#include <cstdint>
+#include <cstring>
+
+using namespace canvas;
+
+// Tells whether the pixels of each row, except margin pixels at both
+// ends, are equal to pixel
+static bool is_constant(const ImageData & image, const unsigned char * pixel, unsigned int margin = 0) {
+  unsigned int n = image.getNumChannels();
+  for (unsigned int row = 0; row < image.getHeight(); row++) {
+    const unsigned char * data = image.getData() + row * image.getBytesPerRow();
+    for (size_t i = size_t(margin) * n; i < size_t(image.getWidth() - margin) * n; i++) {
+      if (data[i] != pixel[i % n]) return false;
+    }
+  }
+  return true;
+}
+
+static void test_wide(unsigned int width, unsigned int height, unsigned int num_channels) {
+  ImageData image(width, height, num_channels, false);
+  CHECK(image.getBytesPerRow() == size_t(width) * num_channels);
+  CHECK(image.calculateSize() == size_t(width) * height * num_channels);
+  unsigned char * data = image.getData();
+  for (size_t i = 0; i < image.calculateSize(); i++) data[i] = i % num_channels == 3 ? 255 : 64 + i % num_channels;
+
+  ImageDataView view(image);
+  CHECK(view.getRow(height - 1) == data + size_t(height - 1) * width * num_channels);
+
+  // a constant image stays constant away from the transparent edges
+  auto blurred = image.blur(3.0f, 0.0f, KERNEL_BLUR);
+  CHECK(blurred->getWidth() == width && blurred->getHeight() == height);
+  CHECK(is_constant(*blurred, data, 16));
+
+  auto scaled = image.scale(width / 2, height);
+  CHECK(scaled->getWidth() == width / 2 && scaled->getHeight() == height);
+  CHECK(is_constant(*scaled, data));
+
+  if (num_channels == 4) {
+    PackedImageData rgba8(RGBA8, 1, view);
+    CHECK(rgba8.getBytesPerRow() == PackedImageData::getBytesPerRow(width, RGBA8));
+    CHECK(rgba8.calculateSize() == size_t(height) * rgba8.getBytesPerRow());
+    const unsigned char * last = rgba8.getData() + rgba8.calculateSize() - 4;
+    CHECK(!memcmp(last, data + image.calculateSize() - 4, 4));
+
+    // 255 is packed exactly, so the dither error stays zero
+    memset(data, 255, image.calculateSize());
+    PackedImageData rgb565(RGB565, 1, ImageDataView(image));
+    CHECK(rgb565.calculateSize() == size_t(height) * width * 2);
+    const unsigned short * packed = (const unsigned short *)rgb565.getData();
+    bool all_white = true;
+    for (size_t i = 0; i < size_t(width) * height; i++) all_white &= packed[i] == 0xffff;
+    CHECK(all_white);
+  }
+}
+
+static void test_sizes() {
+  CHECK(ImageData::calculateSize(70000, 2, 4) == 560000);
+  CHECK(PackedImageData::getBytesPerRow(70000, RGBA8) >= 280000);
+  CHECK(PackedImageData::calculateSize(70000, 2, 1, RGB_DXT1) == 8 * 17500);
+  CHECK(PackedImageData::calculateSize(70000, 2, 1, RGBA_DXT5) == 16 * 17500);
+
+  if (sizeof(size_t) < 8) return;
+
+  // 2^34 bytes
+  CHECK(ImageData::calculateSize(65536, 65536, 4) == uint64_t(1) << 34);
+  CHECK(PackedImageData::calculateSize(65536, 65536, 1, RGBA8) == uint64_t(1) << 34);
+  // 8 * 25000^2 bytes is more than 2^32
+  CHECK(PackedImageData::calculateSize(100000, 100000, 1, RGB_DXT1) == uint64_t(5000000000));
+  CHECK(PackedImageData::calculateSize(100000, 100000, 1, RGBA_DXT5) == uint64_t(10000000000));
+
+  // each level is a quarter of the previous one, rounded up to blocks
+  size_t level0 = PackedImageData::calculateSize(100000, 100000, 1, RGB_DXT1);
+  size_t level1 = PackedImageData::calculateSize(50000, 50000, 1, RGB_DXT1);
+  CHECK(PackedImageData::calculateOffset(100000, 100000, 1, RGB_DXT1) == level0);
+  CHECK(PackedImageData::calculateOffset(100000, 100000, 2, RGB_DXT1) == level0 + level1);
+  CHECK(PackedImageData::calculateOffset(65536, 65536, 2, RGBA8) == (uint64_t(1) << 34) + (uint64_t(1) << 32));
+
+  ImageDataView view((const unsigned char *)0, 65536, 65536, 4);
+  CHECK(view.getBytesPerRow() == 262144);
+  CHECK(size_t(view.getRow(65535) - view.getRow(0)) == size_t(65535) * 262144);
+}
+
+int main() {
+  test_wide(20000, 4, 4);
+  test_wide(70000, 2, 1);
+  test_wide(70000, 2, 4);
+  test_sizes();
+  return check_failures;
+}